@@ -8,11 +8,25 @@
 // #include <sys/socket.h>
 // #include <netinet/in.h>
 #include <netdb.h>	// for sockaddr_in 
+#include <arpa/inet.h>	// for inet_aton
+#include <netinet/tcp.h>	// for TCP_NODELAY
 #include <fcntl.h>	// for O_RDWR
 #include <termios.h>	// for termios
 #include <unistd.h>		// for getopt
 #include <errno.h>		// for Linux
 #include <signal.h>
+#include <sys/uio.h>	// for writev
+#include <sys/file.h>	// for flock
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdint.h>		// for uint64_t
+#include <sys/eventfd.h>
+#include <sys/stat.h>	// for fchmod
+#include <sys/inotify.h>
+#ifndef SMALL
+#include <pthread.h>
+#endif
+#include "ricoshm.h"	// shared memory display table
 
 #define REVISION "$Revision: 1.4 $"
 /* 1.0 11/02/2008 Initial version copied from Elster 1.3
@@ -27,6 +41,16 @@ static char* id="@(#)$Id: rico.c,v 1.4 2011/05/09 18:08:48 martin Exp $";
 #define PROGNAME "Rico"
 #define LOGON "rico"
 #define LOGFILE "/tmp/rico%d.log"
+// Log lines are collected in memory and written out in batches: every LOGFLUSH ms,
+// when the buffer fills, and before exiting.  Past LOGMAX bytes the file is moved to
+// LOGFILE.1 and started again.
+#ifndef SMALL
+#define LOGBUF 8192
+#else
+#define LOGBUF 2048
+#endif
+#define LOGFLUSH 2000	/* milliseconds */
+#define LOGMAX 262144L
 #define SERIALNAME "/dev/ttyAM0"	/* although it MUST be supplied on command line */
 #define BAUD B9600
 
@@ -39,20 +63,33 @@ static char* id="@(#)$Id: rico.c,v 1.4 2011/05/09 18:08:48 martin Exp $";
 #define NUMRETRIES 3
 #define RETRYDELAY	1000000	/* microseconds */
 // Serial retry params
-#define SERIALNUMRETRIES 10
-#define SERIALRETRYDELAY 1000000 /*microseconds */
+#define SERIALNUMRETRIES 3		/* writes to a reopened port before leaving it for lineTimer */
 // Set to if(0) to disable debugging
+#ifndef SMALL
 #define DEBUG if(debug >= 1)
 #define DEBUG2 if(debug >=2)
+#else
+// Small build profile (make small): every table sized for a board running one or two
+// controllers, no debugging output, log times in UTC without ctime's time zone machinery,
+// and netports given as numbers so there is no resolver.  Nothing is allocated once running.
+// Only the MCP and the lines: no -j, so no pthread, and no -S, -P, -U, -T, -p, -B or -A.
+#define DEBUG if(0)
+#define DEBUG2 if(0)
+#endif
+#ifndef SMALL
+#define OPTIONS "b:dt:slSV1:2:3:f:4:5:6:7:8:D:Lwr:R:P:U:Q:A:c:T:p:x:jB:I:M:"
+#else
+#define OPTIONS "b:dt:slV1:2:3:f:4:5:6:7:8:D:Lwr:R:c:M:"
+#endif
 // If defined, don't open the serial device
 // #define DEBUGCOMMS
 
 /* SOCKET CLIENT */
 
 /* Command line params: 
-1 - device name
-2 - device timeout. Default to 60 seconds
-3 - optional 'nolog' to suppress writing to local logfile
+1 - device name, optionally followed by @bus
+2 - controller number
+1 and 2 may be repeated to drive more controllers from one process
 options:
 -3 first value (kw)
 -8 second value (kg)
@@ -65,62 +102,548 @@ extern
 #endif
 int errno;  
 
+// A Rico frame: 'N', bus, display 1-8, the value right aligned in a field of the display
+// model's width (9 characters for the original panels) and an additive checksum.
+// A frame is always held in FRAMELEN bytes, zero past the checksum; framelen go on the wire.
+#define VALUEMAX 12		/* widest value field of any model */
+#define FRAMELEN (VALUEMAX + 4)
+union frame {
+	unsigned char raw[FRAMELEN];
+	struct {
+		unsigned char N;
+		unsigned char bus;
+		unsigned char displ;
+		char value[VALUEMAX];	// the model's width of it, then the checksum
+	} s;
+};
+// Values are carried as fixed point integers in millionths so that no floating point is
+// needed on the soft-float ARM targets.  Six places covers the widest format, "%9f".
+#define FIXONE 1000000LL
+#define FIXMAX 0x7fffffffffffffffLL	/* largest, about 9.2e12 */
+
+// Display models, chosen with -M.  Each has its value field width, how many displays it has
+// (at most NUMDISPLAYS) and, for values sent without a number of places, the largest shown
+// with 2 places and with 1; anything larger has none.  Every model gets an encoder of its
+// own, with these built in as constants, and ricoframe calls the chosen one.
+#define RICOMODELS \
+	MODEL(Rico9,	9,	8,	9999990000LL,	99999990000LL)		/* the original, and the default */ \
+	MODEL(Rico6,	6,	4,	99990000LL,		999900000LL) \
+	MODEL(Rico12,	12,	8,	9999999990000LL,	99999999900000LL)
+struct model {
+	const char * name;
+	int width;			// characters in the value field
+	int displays;		// numbered from 1
+	void (* encode)(union frame * f, int bus, int display, long long value, int decimals);
+};
+
+// Most frames sent together in one writev
+#define MAXBATCH 16
+// Frames awaiting a reply.  The RS232 port will return ok '<' or fail within 1/10th second.  The RS422 doesn't.
+#define MAXPENDING 16
+#define ACKTIMEOUT 100	/* milliseconds, until the line's round trip time has been measured */
+#define ACKMIN 20		/* bounds for the timeout learned from it */
+#define ACKMAX 1000
+#define NOACKLIMIT 20	/* timeouts in a row, with no reply ever, before a line is taken not to reply */
+#define RETRANSMIT 2	/* times a failed frame is sent again if there is nothing newer */
+// A display failing BREAKERFAILS frames in a row is only tried once every BREAKERTIME ms
+#define BREAKERFAILS 8
+#define BREAKERTIME 30000
+#define RICOACK '<'
+// Transmit scheduling.  Each display holds only its latest unsent frame; frames are released 
+// no faster than the baud rate can carry them, at most TXWINDOW ms of wire time at once.
+#define TXWINDOW 30		/* milliseconds */
+#define STARVED 1000	/* ms a frame can wait before it jumps the priority order */
+#define REFRESH 300		/* default seconds between resending every display's value */
+#define NUMDISPLAYS 8
+// Messages waiting to go to the MCP.  Beyond MCPTXLOW bytes INFO events are dropped;
+// anything that would overflow MCPTXBUF is dropped too.
+#ifndef SMALL
+#define MCPTXBUF 4096
+#define MCPTXLOW 2048
+#else
+#define MCPTXBUF 1024
+#define MCPTXLOW 512
+#endif
+// Netport connections are made without blocking.  After a failure the wait before the 
+// next attempt doubles from CONNECTMIN up to CONNECTMAX ms, less a random part of up to half.
+#define CONNECTMIN 1000
+#define CONNECTMAX 60000
+#define CONNECTTIMEOUT 10000	/* ms to wait for a connect to complete */
+// A connected netport has Nagle off so each batch of frames goes straight out, and is corked
+// while a batch is written so it isn't split across segments.  A peer that has gone away
+// is noticed by keepalive probes after NETKEEPIDLE s of silence, NETKEEPCNT of them NETKEEPINTVL s
+// apart, or when data sent has gone unacknowledged for NETUSERTIMEOUT ms.  A connection that 
+// was up for CONNECTMIN ms or more is reconnected straight away when it is lost.
+#define NETKEEPIDLE 10
+#define NETKEEPINTVL 2
+#define NETKEEPCNT 3
+#define NETUSERTIMEOUT 5000
+// The MCP is local so it is retried sooner: from MCPRETRYMIN doubling up to MCPRETRYMAX ms.
+// Messages for it are queued meanwhile and sent after the logon.
+#define MCPRETRYMIN 50
+#define MCPRETRYMAX 2000
+// Longest message accepted from the MCP. Anything longer is discarded.
+#define MAXMSG 255
+// Binary form of disps: this byte then per display: display, decimals (-1 auto), 
+// scale (digits after the point) and a 32 bit big-endian integer value*10^scale
+#define BATCHMARK 0x01
+#define BATCHITEM 7
+
+// Counters for the stats command and SIGUSR1, kept per line and per display.  Latency runs
+// from the value arriving from the MCP to the display's ACK.  Bucket 0 counts under 1 ms, 
+// bucket n from 2^(n-1) to under 2^n ms and the last bucket anything longer.
+#define LATBUCKETS 12
+struct counts {
+	long sent, acked, naked, timedout, retries;
+	long suppressed;	// values not sent as the display already has them
+	long refreshed;		// values sent again by the refresh timer
+	long latency[LATBUCKETS];
+};
+
+// What goes with a frame from its display slot to the pending queue, and back if it fails
+struct origin {
+	long long rcvd;		// msNow() when its value came from the MCP
+	int tries;		// times it has been sent already
+};
+
+// A serial line or netport and the frames sent on it still waiting for a reply, oldest first.
+// Several controllers on different bus addresses may share one line.
+struct line {
+	int fd;
+	char * name;
+	int baud;
+	struct termios oldSettings;	// restored on close
+	struct {
+		union frame f;
+		long long sent;		// msNow() when it will have been on the wire
+		struct origin o;
+	} pending[MAXPENDING];
+	int head, npending;
+	int frametime;		// ms to send one frame at this baud rate
+	long long busy;			// msNow() when the frames already written will be on the wire
+	int burst;			// frames to release together next time, whatever TXWINDOW says
+	struct controller * owner;	// first controller on the line; hears about its problems
+	int next;			// controller to serve first next time round
+	int netport;		// hostname:port rather than a serial device
+	struct sockaddr_in addr;	// where the netport is, once resolved
+	int connecting;		// non-blocking connect in progress
+	long long retry;			// msNow() of the next connect attempt while fd is -1, else when this one started
+	int backoff;		// ms to wait after the next failure
+	int warned;			// failure to connect already reported
+	struct counts count;	// all frames on the line
+	long reopens;		// attempts to reopen or reconnect after a failure
+	long long bytes;	// written
+	int srtt, rttvar;	// smoothed time from a frame being on the wire to its reply and its
+						// mean deviation, as in TCP: in eighths and quarters of a ms
+	int ato;			// ms to wait for a reply
+	int noack;			// the line has never replied: don't wait for it
+	int silent;			// timeouts in a row
+	long long refreshdue;	// msNow() when every display's value is next sent again
+};
+
+// Producers may send raw samples for a display with "sample N val" and leave rico to send an
+// aggregate of them every aggperiod ms.  "agg N mode [seconds [places]]" picks what: the mean,
+// min or max of the samples in the window, or kw, the rate of change of cumulative kWh
+// samples across it.  A display's first sample sets it up as a mean over AGGWINDOW seconds.
+// The window is kept as AGGBUCKETS buckets of samples so each sample costs the same however
+// many arrive; a bucket is dropped as a whole when it falls out of the window.
+#define AGGBUCKETS 16
+#define AGGWINDOW 60	/* default seconds */
+#define AGGPERIOD 5		/* default seconds between sending aggregates */
+#define AGG_NONE 0
+#define AGG_MEAN 1
+#define AGG_MIN 2
+#define AGG_MAX 3
+#define AGG_KW 4
+struct agg {
+	int mode;			// AGG_ ...
+	int width;			// ms covered by each bucket
+	int decimals;		// places to show
+	int cur;			// bucket samples are going into
+	long long start;			// msNow() when it started
+	struct {
+		long n;
+		long long sum, min, max;
+		long long first;	// earliest sample in it, and when it came
+		long long firstat;
+	} b[AGGBUCKETS];
+	long n;				// samples in the whole window
+	long long sum;
+	long long last;		// latest sample, and when it came
+	long long lastat;
+};
+
+// With -T every message acted on, every batch of frames written, as the bytes that went on
+// the wire, and every reply read is added to a binary trace file, each record headed by the ms since tracing began, what it is, which
+// controller or line, and its length, in the machine's byte order.  -p plays a trace's
+// messages back, at -x times the speed they came in or with -x0 as fast as the lines will
+// take them, and reports how long it took.  The records go out in TRACEBUF lots, at least 
+// every LOGFLUSH ms.
+#define TRACEMAGIC "RICOTR1\n"
+#define TRACEBUF 65536
+#define TR_MSG 1
+#define TR_FRAMES 2
+#define TR_REPLY 3
+#define REPLAYBATCH 64	/* messages per pass of the main loop when playing back flat out */
+#define REPLAYDRAIN 10000	/* ms to let the lines finish after the last message */
+
+// -B sends the values in a file, or on stdin for -, down the first controller's line and
+// exits, as -1 to -8 do for one value.  The input is lines of "N val [places]", places
+// defaulting to -D, or BULKMAGIC followed by struct bulkrec records in the machine's byte
+// order.  Values are taken as fast as they come, BULKBATCH at a time, or one every -I ms;
+// a display given values faster than the line can carry them only shows the latest.  What
+// was sent and what failed is reported at the end.
+#define BULKMAGIC "RICOBK1\n"
+#define BULKBUF 4096
+#define BULKBATCH 64	/* values taken per pass when not paced */
+struct bulkrec {
+	int64_t value;		// in millionths, as in ricoshm.h
+	int8_t display;
+	int8_t decimals;	// -1 to place the point automatically
+	uint8_t pad[6];
+};
+struct tracerec {
+	uint32_t ms;
+	uint8_t type;		// TR_...
+	uint8_t index;		// into controllers[] for TR_MSG, lines[] for the others
+	uint16_t len;		// bytes following
+};
+
+// Two thread mode (-j): the main thread has the MCP, clients and everything else that makes
+// frames, and a second thread has the lines.  Frames go to the line thread, and what it has
+// to log comes back, through bounded single producer, single consumer rings that neither
+// side ever waits on, so a line that stalls can't hold up the MCP.  A frame the update ring
+// has no room for is kept, latest per display, until it has.
+#define UPDATES 256		/* slots in each ring, a power of 2 */
+#define EVENTS 64
+#define UPDATEPOLL 10	/* ms between tries while frames are kept back */
+#define UP_FRAME 0
+#define UP_BURST 1
+#define UP_STATS 2
+struct update {
+	int kind;			// UP_...
+	int ctl;			// index into controllers[]
+	int n;				// display for a frame, frames for a burst, withline for stats
+	long long rcvd;			// msNow() the value came in
+	union frame f;
+};
+struct event {
+	int severity;
+	int ctl;
+	char text[176];		// as logmsg truncates
+};
+struct ring {
+	unsigned head;		// only the producer moves it; read by the other side with __atomic
+	unsigned tail;		// only the consumer moves it
+	unsigned size, item;		// slots and the bytes in each
+	char * data;
+	int efd;			// eventfd the consumer waits on
+	int kick;			// producer has put something since it last woke the consumer
+};
+
+// Where kw, kwh, w and disp values go.  Each command has up to ROUTEMAX displays, each with
+// a scale and places; the defaults below come from -w and -f and can be overridden by the 
+// -c file, which is read again on SIGHUP or whenever it is rewritten.  Lines of it are
+// "command display scale places" where command is kw, kwh, w or disp1 to disp8, places is 
+// a number, auto or - for as sent, and display 0 sends the command nowhere.
+#define ROUTE_KW 0
+#define ROUTE_KWH 1
+#define ROUTE_W 2
+#define ROUTE_DISP 2	/* plus the display number */
+#define ROUTES (ROUTE_DISP + NUMDISPLAYS + 1)
+#define ROUTEMAX 4
+#define ROUTEASIS -2	/* places: whatever the message gave */
+#define ROUTEFILEMAX 4096	/* longest routing file */
+struct route {
+	int n;
+	struct {
+		int display;
+		long long scale;	// in millionths
+		int decimals;
+	} to[ROUTEMAX];
+};
+
+// A Rico controller: one bus address on a line, with its own identity and connection to the MCP
+struct controller {
+	char * device;		// as given on the command line
+	struct line * line;
+	int bus;
+	int num;			// controllernum, used in logon and messages
+	int sockfd;			// connection to MCP, -1 while there isn't one
+	int connecting;		// non-blocking connect to the MCP in progress
+	int up;				// logged on: messages can be written
+	long long retry;			// msNow() of the next connect attempt, or start of this one
+	int backoff;		// ms to wait after the next failure
+	int warned;			// loss of the MCP already reported
+	int active;			// cleared when the MCP asks it to exit
+	int online;			// used to prevent messages every minute in the event of disconnection
+	long long lastdata;		// msNow() of last message from server
+	unsigned char rx[2 + MAXMSG + 1];	// messages from the MCP as they arrive: length then text
+	int rxlen;			// bytes in rx
+	int skip;			// bytes still to discard of an oversize message
+	char tx[MCPTXBUF];	// length prefixed messages the socket would not take yet
+	int txlen;
+	int txskip;			// bytes at the front of tx left over from a partly written message
+	int dropped;		// messages dropped since the queue last emptied
+	int waitout;		// epoll is watching for the socket to be writable
+	struct {
+		union frame f;
+		long long queued;	// msNow() when stored, 0 if empty
+		struct origin o;
+		int fails;		// frames in a row that have failed
+		long long hold;		// msNow() before which the breaker stops it being sent
+		union frame shown;	// what the display should be showing, if showing is set
+		int showing;	// shown has been sent and has not failed
+	} slot[NUMDISPLAYS + 1];	// indexed by display number
+	struct counts count[NUMDISPLAYS + 1];	// likewise
+#ifndef SMALL
+	struct ricoshm * shm;	// shared memory display table with -S
+	uint32_t shmseq[NUMDISPLAYS + 1];	// sequence of each of its slots last read
+	struct agg agg[NUMDISPLAYS + 1];	// samples for each display
+	long long aggdue;		// msNow() when the aggregates are next sent
+#endif
+};
+
+// Listen mode: with -P and -U local clients send values in the same messages as the MCP.
+// They may only send display values, at no more than clientrate messages a second with up
+// to a second's worth saved up.  A client over its rate is not read until it has earned 
+// another message, so it is held back by its socket filling rather than losing values.
+#define MAXCLIENTS 32
+#define CLIENTRATE 50	/* default messages per second per client */
+#define LISTENADDR "127.0.0.1"	/* for -P given just a port */
+struct client {
+	int fd;				// -1 for a free entry
+	struct controller * c;	// where its values go: the first controller until it says otherwise
+	unsigned char rx[2 + MAXMSG + 1];	// as for the MCP
+	int rxlen;
+	int skip;
+	long credit;		// messages it may send, in thousandths
+	long long stamp;			// msNow() when credit was last added
+	int paused;			// epoll has stopped watching it until it has credit again
+};
+
+#ifndef SMALL
+#define MAXLINES 16
+#define MAXCONTROLLERS 16
+#else
+#define MAXLINES 2
+#define MAXCONTROLLERS 2
+#endif
+// epoll event data: kind in the top half, index into lines[] or controllers[] in the bottom
+#define EV_TIMER	0
+#define EV_LINE		1
+#define EV_MCP		2
+#define EV_SHM		3	/* a producer has written to the shared memory table */
+#define EV_SHMSOCK	4	/* a producer wants the eventfd */
+#define EV_LISTEN	5	/* a client is connecting: index 0 for TCP, 1 for the unix socket */
+#define EV_CLIENT	6
+#define EV_CONFIG	7	/* inotify: something in the routing file's directory has changed */
+#define EV_QUEUE	8	/* -j: the other thread has put something in a ring */
+#define EV_BULK		9	/* -B: more input */
+#define MAXEVENTS 16
+
 // Procedures in this file
 int openSerial(const char * name, int baud, int parity, int databits, int stopbits);  // return fd
-void closeSerial(int fd);  // restore terminal settings
+int resolveNetport(struct line * l);	// look up hostname:port; 0 if ok
+void lineConnect(struct line * l);	// start connecting a netport
+void lineUp(struct line * l);		// netport has connected
+void lineDown(struct line * l, int err);	// line has failed: try again later
+int lineTimer(struct line * l);		// everything due on a line; return ms until more is or -1
+void lineEvent(struct line * l, int events);	// line is readable or has connected
+int queued(struct line * l);		// frames waiting to be sent
+void refreshLine(struct line * l);	// send every display's value again
+struct line * openLine(char * name, int baud);	// open or share a line
+void closeSerial(struct line * l);  // restore terminal settings
+void mcpConnect(struct controller * c);	// start connecting to the MCP
+void mcpUp(struct controller * c);		// connected: log on and send the queue
+void mcpDown(struct controller * c, int err);	// lost the MCP: try again later
+int mcpTimer(struct controller * c);	// reconnect if due; return ms until next attempt or -1
+int mcpEvent(struct controller * c, int events, long long factor);	// socket ready; 0 to shut down
+void watch(int fd, int kind, int index);	// add fd to the epoll set
 void sockSend(const char * msg);	// send a string
-int sendSerials(int fd, unsigned char *data, int len);
-int sendSerial(int fd, unsigned char data);
-int processSocket(int fd, float factor);			// process server message
+void mcpFlush(struct controller * c);	// write queued messages; socket is writable
+void watchOut(struct controller * c, int on);	// whether to wait for the socket to be writable
+int sendFrames(struct line * l, union frame * f, int n);	// write n frames; return number sent
+int reopenLine(struct line * l);	// reopen after an error; return 0 if ok
+int processSocket(struct controller * c, long long factor);			// process server messages
+int takeMessages(struct controller * c, struct client * cl, unsigned char * rx, int * rxlen, int * skip, long long factor);	// split up messages
+int command(struct controller * c, char * msg, int len, long long factor);		// act on one message
+int disp(struct controller * c, int num, long long val, int decimals);	// disp command; 0 if ok
+int scanDisp(char * s, int * num, long long * val, int * decimals);	// like sscanf "%d %f %d"
+void route(struct controller * c, int r, long long val, int decimals);	// send a value where the routes say
+void routeDefaults(long long factor);	// the routes the options give
+void routeLoad(void);			// read the routing file and switch to it
+void routeWatch(void);			// reload the routing file when it changes
+void traceOpen(char * name);	// start recording
+void trace(int type, int index, const void * data, int len);	// add a record
+void traceFlush(void);			// write out the records
+void traceWrite(void);			// write them out, with tracelock held
+int traceTimer(long long now);		// write them out if due; return ms until they will be or -1
+void replayOpen(char * name);	// map a trace to play back
+int replayTimer(long long factor);	// play back what is due; return ms until more is or -1
+int bulk(struct controller * c, char * name, int pace, int decimals, int tmout, long long factor);	// send a stream of values; return exit status
+int bulkTake(struct controller * c, char * in, int len, int end, int * binary, int decimals, long * records, long * bad);	// send one; return bytes used
+void aggSet(struct controller * c, int num, int mode, int seconds, int decimals);	// start aggregating a display
+void aggSample(struct controller * c, int num, long long val);	// take a raw sample
+void aggAdvance(struct agg * a, long long now);	// drop buckets that have left the window
+int aggTimer(struct controller * c);	// send aggregates if due; return ms until next or -1
+int parseFixed(const char * s, long long * val, char ** end);	// decimal string to millionths
+long long fixMul(long long a, long long b);		// product of two fixed point values
 void logmsg(int severity, char *msg);	// Log a message to server and file
+void logput(const char * text, int len);	// add to the log buffer
+void logflush(void);		// write out the log buffer
 void usage(void);					// standard usage message
 char * getversion(void);
-void ricosend (int fd, int display, float value, int decimals);
+int ricoframe(union frame * f, int bus, int display, long long value, int decimals);	// build a frame; 0 if ok
+#define MODEL(name, width, displays, auto2, auto1) \
+void encode##name(union frame * f, int bus, int display, long long value, int decimals);	// build one for this model
+RICOMODELS
+#undef MODEL
+struct model * modelFind(const char * name);	// look a model up by name; NULL if there is none
+void ricosend (struct controller * c, int display, long long value, int decimals);
+void ricoqueue(struct controller * c, int display, union frame * f, long long rcvd);	// store a frame in its slot
+void burst(struct controller * c, int n);	// the last n frames go on the wire together
+void ricowrite(struct line * l, union frame * f, struct origin * o, int n);	// send frames and queue them for a reply
+struct controller * busController(struct line * l, int bus);	// which controller a frame is for
+int pump(struct line * l);		// release frames at the baud rate; return ms until next or -1
+int frameTime(int baud);		// ms to transmit a frame
+void readReply(struct line * l);		// match replies to pending frames
+int ackTimeout(struct line * l);		// expire old frames; return ms until the next expiry or -1
+long long msNow(void);			// monotonic milliseconds
+void stampTime(time_t t, char * s);	// ctime() in UTC, without its newline
+void settle(struct line * l, int what);	// deal with the reply to the oldest pending frame
+void learnRtt(struct line * l, long rtt);	// update the ack timeout from a round trip
+void stats(struct controller * c, int withline);	// report the counters
+int countsText(char * s, struct counts * k);	// format counters; return length
+int latencyText(char * s, struct counts * k);	// format the latency histogram; return length
+void shmOpen(void);				// create the shared memory tables and eventfd
+void shmAccept(void);			// hand the eventfd to a producer
+void shmDrain(struct controller * c);	// send whatever producers have changed
+void listenOpen(char * port, char * path);	// start listening for clients
+void clientAccept(int index);		// take new clients from a listening socket
+void clientEvent(struct client * cl, long long factor);	// a client has sent something
+int clientCredit(struct client * cl);	// take one message's credit; 0 if it has none
+void clientCommand(struct client * cl, char * msg, int len, long long factor);	// act on a client's message
+int clientTimer(long long factor);	// resume clients that have credit; return ms until the next or -1
+void clientClose(struct client * cl);	// hang up on a client
+int ringPut(struct ring * r, const void * item);	// add an item; 0 if full
+int ringGet(struct ring * r, void * item);	// take the oldest item; 0 if empty
+void ringKick(struct ring * r);		// wake the consumer if there is anything new
+void post(struct update * u);	// pass an update to the line thread
+int postHeld(void);			// retry frames the ring was full for; return ms until next or -1
+void takeEvents(void);		// log what the line thread has sent back
+void startLines(void);		// start the line thread
+void * lineThread(void * arg);	// serve the lines
 void catcher(int sig);			// Signal catcher needed for SIGPIPE
 
 /* GLOBALS */
-FILE * logfp = NULL;
-int sockfd = 0;
+int logfd = -1;
+char logname[64];		// LOGFILE for the first controller
+long logmax = LOGMAX;	// rotate past this size, 0 for never
+char logbuf[LOGBUF];	// lines not yet written
+int loglen = 0;
+long long logdue = 0;		// msNow() when logbuf must be written
+long logsize = 0;		// bytes in the file
 int debug = 0;
 int noserver = 0;		// prevents socket connection when set to 1
-int controllernum = -1;	//	only used in logon message
-char buffer[256];		// For messages
-char * serialName = SERIALNAME;
-int bus = 1;
+struct model models[] = {
+#define MODEL(name, width, displays, auto2, auto1) {#name, width, displays, encode##name},
+	RICOMODELS
+#undef MODEL
+};
+struct model * model = models;	// -M
+int framelen = 4 + 9;		// bytes of its frames on the wire
+__thread char buffer[256];		// For messages
 int watts = 0;		// Interpret the kw figure as watts instead
+long refresh = REFRESH * 1000L;		// ms between refreshes, 0 for never
+struct route routetab[3][ROUTES];	// defaults, then two for the routing file to take turns
+struct route * routes = routetab[0];	// in use
+char * routefile = NULL;	// -c
+int inotifyfd = -1;
+volatile int reloaddue = 0;	// SIGHUP has asked for the routing file to be read again
+#ifndef SMALL
+long aggperiod = AGGPERIOD * 1000L;		// ms between sending aggregates
+int tracefd = -1;
+char tracebuf[TRACEBUF];	// records not yet written
+int tracelen = 0;
+long long tracestart;		// msNow() when the trace began
+long long tracedue;			// msNow() when tracebuf must be written
+pthread_mutex_t tracelock = PTHREAD_MUTEX_INITIALIZER;	// -j: both threads add records
+unsigned char * replay = NULL;	// trace being played back
+size_t replaylen, replaypos;
+long long replaystart;		// msNow() playback began
+long long replayend = 0;		// msNow() the last message was played
+long replayed = 0;		// messages
+int replayspeed = 1;	// times faster than recorded, 0 for flat out
+int threaded = 0;		// -j
+__thread int linethread = 0;	// this is the line thread
+int lineepfd = -1;		// its epoll set
+int stopping = 0;	// main has finished: the line thread should too
+pthread_t linetid;
+struct update updatebuf[UPDATES];
+struct event eventbuf[EVENTS];
+struct ring updates = {0, 0, UPDATES, sizeof(struct update), (char *) updatebuf, -1, 0};	// to the line thread
+struct ring events = {0, 0, EVENTS, sizeof(struct event), (char *) eventbuf, -1, 0};	// and back
+struct update held[MAXCONTROLLERS][NUMDISPLAYS + 1];	// frames waiting for room; rcvd 0 if none
+int nheld = 0;
+long lostevents = 0;	// times the event ring was full; only the line thread changes it
+long posted = 0;			// updates put in the ring
+long updatesidle = 0;	// of them, acted on by the line thread when it last found every line idle
+#endif
+struct line lines[MAXLINES];
+int numlines = 0;
+struct controller controllers[MAXCONTROLLERS];
+int numcontrollers = 0;
+__thread struct controller * ctl = &controllers[0];	// the one being serviced: logmsg reports to its MCP
+__thread int epfd = -1;		// epoll set for all lines and MCP connections, or with -j this thread's
+volatile int statsdue = 0;	// SIGUSR1 has asked for the counters
+#ifndef SMALL
+int shmevfd = -1;		// eventfd producers write to after changing a shared memory table
+int shmsock = -1;		// where they get it from
+int listenfd[2] = {-1, -1};	// listen mode TCP and unix sockets
+char * listenpath = NULL;	// the unix socket's name, removed on exit
+struct client clients[MAXCLIENTS];
+int clientrate = CLIENTRATE;
+#endif
 
 /********/
 /* MAIN */
 /********/
 int main(int argc, char *argv[])
-// arg1: serial device file
-// arg2: optional timeout in seconds, default 90
-// arg3: optional 'nolog' to carry on when filesystem full
+// args: serial device file or hostname:port, optionally followed by @bus, then controllernum.
+// Repeat the pair for each further controller, on the same or another line.
 {
-    int commfd;
+	struct line * l;
+	struct controller * c;
 	int nolog = 0;
+	int wait, n, i;
+	long long now;
+	struct epoll_event ev[MAXEVENTS];
+	int timerfd = -1;
+	struct itimerspec its;
+	uint64_t expiries;
 
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-	time_t next;
-
-	int run = 1;		// set to 0 to stop main loop
-	fd_set readfd; 
-	int numfds;
-	struct timeval timeout;
 	int tmout = 690;		//seconds between messages
 	int logerror = 0;
-	int online = 1;		// used to prevent messages every minute in the event of disconnection
-	float factor = 0.43;		// CO2 kwh -> kg conversion
-	float value;
+	long long factor = 430000;		// CO2 kwh -> kg conversion, 0.43
+	long long value;
 	int display = 0, decimals = 0;
+#ifndef SMALL
+	int useshm = 0;
+	char * tracename = NULL, * replayname = NULL;
+	char * listenport = NULL, * unixpath = NULL;
+	char * bulkname = NULL;
+	int pace = 0;		// -B: ms between values, 0 for as fast as they come
+#endif
 	int option; 
 	int baud = BAUD;
+	int bus = 1;
+	char * cp;
 	// Command line arguments
 	
 	// optind = -1;
 	opterr = 0;
-	while ((option = getopt(argc, argv, "b:dt:slV1:2:3:f:4:5:6:7:8:D:Lw")) != -1) {
+	while ((option = getopt(argc, argv, OPTIONS)) != -1) {
 		switch (option) {
 		case 'b': bus = atoi(optarg); break;
 		case 's': noserver = 1; break;
@@ -128,120 +651,327 @@ int main(int argc, char *argv[])
 		case '?': usage(); exit(1);
 		case 't': tmout = atoi(optarg); break;
 		case 'd': debug++; break;
-		case '1': display = 1; value = atof(optarg); break;
-		case '2': display = 2; value = atof(optarg); break;
-		case '3': display = 3; value = atof(optarg); break;
-		case '4': display = 4; value = atof(optarg); break;
-		case '5': display = 5; value = atof(optarg); break;
-		case '6': display = 6; value = atof(optarg); break;
-		case '7': display = 7; value = atof(optarg); break;
-		case '8': display = 8; value = atof(optarg); break;
+		case '1': display = 1; parseFixed(optarg, &value, NULL); break;
+		case '2': display = 2; parseFixed(optarg, &value, NULL); break;
+		case '3': display = 3; parseFixed(optarg, &value, NULL); break;
+		case '4': display = 4; parseFixed(optarg, &value, NULL); break;
+		case '5': display = 5; parseFixed(optarg, &value, NULL); break;
+		case '6': display = 6; parseFixed(optarg, &value, NULL); break;
+		case '7': display = 7; parseFixed(optarg, &value, NULL); break;
+		case '8': display = 8; parseFixed(optarg, &value, NULL); break;
 		case 'L': baud = B2400; break;
-		case 'f': factor = atof(optarg); break;
+		case 'f': parseFixed(optarg, &factor, NULL); break;
 		case 'D': decimals = atoi(optarg); break;
 		case 'w': watts = 1; break;
+		case 'r': logmax = atol(optarg) * 1024; break;
+		case 'R': refresh = atol(optarg) * 1000; break;
+		case 'c': routefile = optarg; break;
+#ifndef SMALL
+		case 'S': useshm = 1; break;
+		case 'P': listenport = optarg; break;
+		case 'U': unixpath = optarg; break;
+		case 'Q': clientrate = atoi(optarg); break;
+		case 'T': tracename = optarg; break;
+		case 'p': replayname = optarg; noserver = 1; break;	// the trace stands in for the MCP
+		case 'x': replayspeed = atoi(optarg); break;
+		case 'j': threaded = 1; break;
+		case 'B': bulkname = optarg; break;
+		case 'I': pace = atoi(optarg); break;
+		case 'A': if (atol(optarg) > 0) aggperiod = atol(optarg) * 1000; break;
+#endif
+		case 'M': 
+			if (!(model = modelFind(optarg))) {
+				fprintf(stderr, "No display model %s:", optarg);
+				for (i = 0; i < sizeof(models) / sizeof(models[0]); i++) fprintf(stderr, " %s", models[i].name);
+				fprintf(stderr, "\n");
+				exit(1);
+			}
+			framelen = 4 + model->width;
+			break;
 		case 'V': printf("Version %s %s\n", getversion(), id); exit(0);
 		}
 	}
 	
 	DEBUG fprintf(stderr, "Debug on. optind %d argc %d Bus = %d Display = %d\n", optind, argc, bus, display);
 	
-	if (optind < argc) serialName = argv[optind];		// get seria/device name: parameter 1
-	optind++;
-	if (optind < argc) controllernum = atoi(argv[optind]);	// get optional controller number: parameter 2
+	// Each controller is a device name (with an optional @bus) followed by its controller number
+	do {
+		if (numcontrollers == MAXCONTROLLERS) {
+			fprintf(stderr, "Too many controllers: at most %d\n", MAXCONTROLLERS);
+			exit(1);
+		}
+		c = &controllers[numcontrollers++];
+		c->device = SERIALNAME;		/* although it MUST be supplied on command line */
+		c->bus = bus;
+		c->num = -1;
+		if (optind < argc) c->device = argv[optind];		// get serial/device name: parameter 1
+		optind++;
+		if (optind < argc) c->num = atoi(argv[optind]);	// get optional controller number: parameter 2
+		optind++;
+		if ((cp = strrchr(c->device, '@'))) {
+			*cp++ = '\0';
+			c->bus = atoi(cp);
+		}
+		c->active = c->online = 1;
+	} while (optind < argc);
+	
+	sprintf(logname, LOGFILE, controllers[0].num);
 	
-	sprintf(buffer, LOGFILE, controllernum);
+	routeDefaults(factor);
+#ifndef SMALL
+	if (tracename) traceOpen(tracename);
+#endif
 	
-	if (!nolog) if ((logfp = fopen(buffer, "a")) == NULL) logerror = errno;
+	if (!nolog) if ((logfd = open(logname, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) logerror = errno;
+	if (logfd >= 0) logsize = lseek(logfd, 0, SEEK_END);
 	
 	// There is no point in logging the failure to open the logfile
 	// to the logfile, and the socket is not yet open.
 
-	sprintf(buffer, "STARTED %s on %s as %d timeout %d %s", argv[0], serialName, controllernum, tmout, nolog ? "nolog" : "");
-	logmsg(INFO, buffer);
+	for (c = controllers; c < controllers + numcontrollers; c++) {
+		ctl = c;
+		sprintf(buffer, "STARTED %s on %s bus %d as %d timeout %d %s", argv[0], c->device, c->bus, c->num, tmout, nolog ? "nolog" : "");
+		logmsg(INFO, buffer);
+	}
 	
-	// Set up socket 
-	if (!noserver) {
-		sockfd = socket(AF_INET, SOCK_STREAM, 0);
-		if (sockfd < 0) 
-			logmsg(FATAL, "FATAL " PROGNAME " Creating socket");
-		server = gethostbyname("localhost");
-		if (server == NULL) {
-			logmsg(FATAL, "FATAL " PROGNAME " Cannot resolve localhost");
-		}
-		bzero((char *) &serv_addr, sizeof(serv_addr));
-		serv_addr.sin_family = AF_INET;
-		bcopy((char *)server->h_addr, 
-			 (char *)&serv_addr.sin_addr.s_addr,
-			 server->h_length);
-		serv_addr.sin_port = htons(PORTNO);
-		if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0) {
-			sockfd = 0;
-			logmsg(ERROR, "ERROR " PROGNAME " Connecting to socket");
-		}	
-		
-		if (flock(commfd, LOCK_EX | LOCK_NB) == -1) {
-			sprintf(buffer, "FATAL " PROGNAME " is already running, cannot start another one on %s", serialName);
-			logmsg(FATAL, buffer);
-		}
+	if ((epfd = epoll_create1(0)) < 0 || (timerfd = timerfd_create(CLOCK_MONOTONIC, 0)) < 0)
+		logmsg(FATAL, "FATAL " PROGNAME " Creating epoll set");
+	watch(timerfd, EV_TIMER, 0);
+	if (routefile) {
+		ctl = &controllers[0];
+		routeLoad();
+	}
+	srandom(getpid());		// spreads out netport reconnects
 	
-		// Logon to server
-		sprintf(buffer, "logon rico %s %d %d", getversion(), getpid(), controllernum);
-		sockSend(buffer);
+	// Set up sockets, one per controller so each logs on under its own number 
+	for (c = controllers; c < controllers + numcontrollers; c++) {
+		ctl = c;
+		if (!noserver) {
+			c->sockfd = -1;
+			mcpConnect(c);		// logs on when it connects
+		}
+		else	c->sockfd = 1;		// noserver: use stdout
 	}
-	else	sockfd = 1;		// noserver: use stdout
 	
-		// Open serial port
-	if ((commfd = openSerial(serialName, baud, 0, CS8, 1)) < 0) {
-		sprintf(buffer, "ERROR " PROGNAME " %d Failed to open %s: %s", controllernum, serialName, strerror(errno));
-#ifdef DEBUGCOMMS
-		logmsg(INFO, buffer);			// FIXME AFTER TEST
-		printf("Using stdio\n");
-		commfd = 0;		// use stdin
-#else
-		logmsg(FATAL, buffer);
+	// Open serial ports.  With -j they go in the line thread's epoll set.
+#ifndef SMALL
+	if (display || bulkname) threaded = 0;
+	if (threaded && (lineepfd = epoll_create1(0)) < 0)
+		logmsg(FATAL, "FATAL " PROGNAME " Creating epoll set");
+	i = epfd;
+	if (threaded) epfd = lineepfd;
 #endif
+	for (c = controllers; c < controllers + numcontrollers; c++) {
+		ctl = c;
+		c->line = openLine(c->device, baud);
 	}
+#ifndef SMALL
+	epfd = i;
+#endif
 
 	// If we failed to open the logfile and were NOT called with nolog, warn server
 	// Obviously don't use logmsg!
-	if (logfp == NULL && nolog == 0) {
-		sprintf(buffer, "event WARN " PROGNAME " %d could not open logfile %s: %s", controllernum, LOGFILE, strerror(logerror));
+	if (logfd < 0 && nolog == 0) {
+		ctl = &controllers[0];
+		sprintf(buffer, "event WARN " PROGNAME " %d could not open logfile %s: %s", ctl->num, LOGFILE, strerror(logerror));
 		sockSend(buffer);
 	}
 		
-	numfds = (sockfd > commfd ? sockfd : commfd) + 1;		// nfds parameter to select. One more than highest descriptor
-
-	if (display) {	// command line value
-		ricosend(commfd, display, value, decimals);
+	if (display) {	// command line value goes to the first controller
+		ctl = c = &controllers[0];
+		l = c->line;
+		ricosend(c, display, value, decimals);
+		// Send it and wait for the reply, if there is going to be one.  A netport
+		// gets up to the timeout to connect.
+		now = msNow();
+		while (msNow() - now < tmout * 1000L) {
+			wait = lineTimer(l);
+			if (!queued(l) && !l->npending) break;
+			i = now + tmout * 1000L - msNow();
+			if (wait < 0 || wait > i) wait = i;
+			if ((n = epoll_wait(epfd, ev, MAXEVENTS, wait)) < 0 && errno != EINTR) break;
+			for (i = 0; i < n; i++)
+				if (ev[i].data.u32 >> 16 == EV_LINE) lineEvent(l, ev[i].events);
+				else if (ev[i].data.u32 >> 16 == EV_MCP) mcpEvent(c, ev[i].events, factor);
+		}
+		if (c->up) mcpFlush(c);
 		fprintf(stderr, "\n");
-		close(commfd);
+		closeSerial(l);
+#ifndef SMALL
+		traceFlush();
+#endif
+		logflush();
 		return 0;		// and exit
 	}
+#ifndef SMALL
+	if (bulkname) {		// and so do values from a file
+		ctl = c = &controllers[0];
+		i = bulk(c, bulkname, pace, decimals, tmout, factor);
+		if (c->up) mcpFlush(c);
+		closeSerial(c->line);
+		traceFlush();
+		logflush();
+		return i;
+	}
+#endif
 	
-	// Main Loop
+	// Main Loop.  Replies from the displays are matched to sent frames as they arrive
+	// so the servers are never kept waiting for them.  All timing is done by the timerfd,
+	// armed for whatever falls due first.
 	signal(SIGPIPE, catcher);
-	FD_ZERO(&readfd); 
-	DEBUG fprintf(stderr, "Now is %d next is %d\n", time(NULL), next);
-	while(run) {
-		timeout.tv_sec = tmout;
-		timeout.tv_usec = 0;
-		FD_SET(sockfd, &readfd);
-		if (select(numfds, &readfd, NULL, NULL, &timeout) == 0) {	// select timed out. Bad news 
-			if (online == 1) {
-				logmsg(WARN, "WARN " PROGNAME " No data for last period");
-				online = 0;	// Don't send a message every minute from now on
+	signal(SIGUSR1, catcher);
+	signal(SIGHUP, catcher);
+	if (routefile) routeWatch();
+	for (c = controllers; c < controllers + numcontrollers; c++) c->lastdata = msNow();
+#ifndef SMALL
+	if (useshm) shmOpen();
+	if (listenport || unixpath) listenOpen(listenport, unixpath);
+	if (replayname) replayOpen(replayname);
+	if (threaded) startLines();
+#endif
+	while(1) {
+#ifdef SMALL
+		wait = -1;
+#else
+		wait = clientTimer(factor);		// first, as they may queue frames
+		if (replay && (n = replayTimer(factor)) >= 0 && (wait < 0 || n < wait)) wait = n;
+		for (c = controllers; c < controllers + numcontrollers; c++) {
+			ctl = c;
+			n = aggTimer(c);
+			if (n >= 0 && (wait < 0 || n < wait)) wait = n;
+		}
+		if (threaded) {		// the lines are the other thread's
+			takeEvents();
+			n = postHeld();
+			if (n >= 0 && (wait < 0 || n < wait)) wait = n;
+			ringKick(&updates);
+		}
+		else
+#endif
+		for (l = lines; l < lines + numlines; l++) {
+			ctl = l->owner;
+			n = lineTimer(l);
+			if (n >= 0 && (wait < 0 || n < wait)) wait = n;
+		}
+		now = msNow();
+		n = 0;
+		for (c = controllers; c < controllers + numcontrollers; c++) {
+			if (!c->active) continue;
+			n++;
+			if (noserver) continue;
+			ctl = c;
+			i = mcpTimer(c);
+			if (i >= 0 && (wait < 0 || i < wait)) wait = i;
+			if (!c->online) continue;
+			if (now - c->lastdata >= tmout * 1000L) {	// Bad news 
+				ctl = c;
+				sprintf(buffer, "WARN " PROGNAME " %d No data for last period", c->num);
+				logmsg(WARN, buffer);
+				c->online = 0;	// Don't send a message every minute from now on
+				continue;
+			}
+			i = c->lastdata + tmout * 1000L - now;	// time left before we complain about the server
+			if (wait < 0 || i < wait) wait = i;
+		}
+		if (n == 0) break;		// every controller has been told to exit
+		if (loglen) {
+			if (now >= logdue) logflush();
+			else if (wait < 0 || logdue - now < wait) wait = logdue - now;
+		}
+#ifndef SMALL
+		n = traceTimer(now);
+		if (n >= 0 && (wait < 0 || n < wait)) wait = n;
+#endif
+		
+		bzero(&its, sizeof(its));
+		if (wait >= 0) {
+			its.it_value.tv_sec = wait / 1000;
+			its.it_value.tv_nsec = (wait % 1000) * 1000000 + 1;	// all zero would disarm it
+		}
+		timerfd_settime(timerfd, 0, &its, NULL);
+		
+		n = epoll_wait(epfd, ev, MAXEVENTS, -1);
+		if (statsdue) {
+			statsdue = 0;
+			for (c = controllers; c < controllers + numcontrollers; c++) stats(c, c == c->line->owner);
+		}
+		if (reloaddue) {
+			reloaddue = 0;
+			ctl = &controllers[0];
+			if (routefile) routeLoad();
+		}
+		if (n < 0) {
+			if (errno != EINTR) {
+				sprintf(buffer, "WARN " PROGNAME " epoll_wait failed: %s", strerror(errno));
+				logmsg(WARN, buffer);
+				sleep(1);
 			}
 			continue;
 		}
-		if ((noserver == 0) && FD_ISSET(sockfd, &readfd)) {
-			online = 1;
-			run = processSocket(commfd, factor);	// the server may request a shutdown by setting run to 0
+		for (i = 0; i < n; i++) {
+			int index = ev[i].data.u32 & 0xffff;
+			switch (ev[i].data.u32 >> 16) {
+			case EV_TIMER:
+				read(timerfd, &expiries, sizeof(expiries));
+				break;
+			case EV_LINE:
+				l = &lines[index];
+				ctl = l->owner;
+				lineEvent(l, ev[i].events);
+				break;
+			case EV_CONFIG:
+				ctl = &controllers[0];
+				routeWatch();
+				break;
+#ifndef SMALL
+			case EV_SHM:
+				read(shmevfd, &expiries, sizeof(expiries));
+				for (c = controllers; c < controllers + numcontrollers; c++) shmDrain(c);
+				break;
+			case EV_SHMSOCK:
+				shmAccept();
+				break;
+			case EV_QUEUE:
+				read(events.efd, &expiries, sizeof(expiries));
+				takeEvents();
+				break;
+			case EV_LISTEN:
+				clientAccept(index);
+				break;
+			case EV_CLIENT:
+				clientEvent(&clients[index], factor);
+				break;
+#endif
+			case EV_MCP:
+				ctl = c = &controllers[index];
+				if (!c->active) break;
+				if (mcpEvent(c, ev[i].events, factor) == 0) {	// the server may request a shutdown
+					logmsg(INFO,"INFO " PROGNAME " Shutdown requested");
+					if (c->up) mcpFlush(c);		// last chance for anything queued
+					if (c->sockfd >= 0) close(c->sockfd);
+					c->sockfd = -1;
+					c->up = 0;
+					c->active = 0;
+				}
+				break;
+			}
 		}
-	}			
-	logmsg(INFO,"INFO " PROGNAME " Shutdown requested");
-	close(sockfd);
-	closeSerial(commfd);
+	}
+#ifndef SMALL
+	if (threaded) {
+		__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+		updates.kick = 1;
+		ringKick(&updates);
+		pthread_join(linetid, NULL);
+		takeEvents();
+	}
+#endif
+	for (l = lines; l < lines + numlines; l++) closeSerial(l);
+#ifndef SMALL
+	if (listenpath) unlink(listenpath);
+	traceFlush();
+#endif
+	logflush();
 
 	return 0;
 }
@@ -250,9 +980,20 @@ int main(int argc, char *argv[])
 /* USAGE */
 /*********/
 void usage(void) {
-	printf("Usage: rico [-lsd] [-f xx.xx] [-bX] [-V] /dev/ttyname controllernum\n");
+	printf("Usage: rico [-lsd] [-f xx.xx] [-bX] [-V] /dev/ttyname[@bus] controllernum [/dev/ttyname[@bus] controllernum ...]\n");
 	printf("-l: no log  -s: no server  -d: debug on\n -V: version -f: CO2 scale factor -3,5,8: test value\n");
-	printf("-w watts instead of kw -L low speed 2400 baud -bX bus X\n");
+	printf("-w watts instead of kw -L low speed 2400 baud -bX default bus X\n");
+	printf("-rN rotate log file at N kbytes (0 never) -RN resend all values every N seconds (0 never)\n");
+	printf("-c file route kw, kwh, w and disp as it says; reread on SIGHUP or change\n");
+	printf("-M model the displays' model, by default Rico9: Rico6 and Rico12 have other widths\n");
+#ifndef SMALL
+	printf("-S take values from local producers through shared memory as well\n");
+	printf("-j serve the lines from a thread of their own\n");
+	printf("-T file record a trace -p file play one back instead of using the MCP -xN at N times speed, 0 flat out\n");
+	printf("-AN send aggregates of sampled displays every N seconds\n");
+	printf("-P [addr:]port -U path listen for clients sending disp, kw, kwh, w -QN at most N messages a second each\n");
+	printf("-B file send \"display value [decimals]\" lines from file, - for stdin, and exit -IN one every N ms\n");
+#endif
 	return;
 }
 
@@ -263,38 +1004,102 @@ void logmsg(int severity, char *msg)
 // Write error message to logfile and socket if possible and abort program for ERROR and FATAL
 // Truncate total message including timestamp to 200 bytes.
 
-// Globals used: sockfd logfp
+// Globals used: ctl->sockfd logfd
 
-// Due to the risk of looping when you call this routine due to a problem writing on the socket,
-// set sockfd to 0 before calling it.
+// While the MCP is away the event is queued for it, so a problem writing on the socket
+// can be reported here without looping.
 
 {
 	char buffer[200];
+	static time_t stamped = 0;
+	static char stamp[26];		// ctime() of stamped, with a space for the newline
 	time_t now;
-	if (strlen(msg) > 174) msg[174] = '\0';		// truncate incoming message string
-	now = time(NULL);
-	strcpy(buffer, ctime(&now));
-	buffer[24] = ' ';	// replace newline with a space
-	strcat(buffer, msg);
-	strcat(buffer, "\n");
-	if (logfp) {
-		fputs(buffer, logfp);
-		fflush(logfp);
+	int len;
+#ifndef SMALL
+	struct event e;
+#endif
+	if ((len = strlen(msg)) > 174) msg[len = 174] = '\0';		// truncate incoming message string
+#ifndef SMALL
+	if (linethread) {	// the main thread logs it, and exits for ERROR and FATAL
+		e.severity = severity;
+		e.ctl = ctl - controllers;
+		strcpy(e.text, msg);
+		if (severity <= WARN) {
+			if (!ringPut(&events, &e)) __atomic_store_n(&lostevents, lostevents + 1, __ATOMIC_RELAXED);
+			return;
+		}
+		while (!ringPut(&events, &e)) usleep(1000);		// this one can't be lost
+		ringKick(&events);
+		for (;;) pause();		// for the main thread to exit: this thread has no signals
+	}
+#endif
+	if (logfd >= 0) {
+		now = time(NULL);
+		if (now != stamped) {	// ctime is only worth calling once a second
+#ifndef SMALL
+			strcpy(stamp, ctime(&now));
+#else
+			stampTime(now, stamp);
+#endif
+			stamp[24] = ' ';	// replace newline with a space
+			stamped = now;
+		}
+		logput(stamp, 25);
+		logput(msg, len);
+		logput("\n", 1);
 	} 
-	if (sockfd > 0) {
+	if (ctl->sockfd) {
 		strcpy(buffer, "event ");
 		strcat(buffer, msg);
 		sockSend(buffer);
 	}
     if (severity > WARN) {		// If severity is ERROR or FATAL terminate program
-		if (logfp) fclose(logfp);
-		if (sockfd) close(sockfd);
+		logflush();
+		if (logfd >= 0) close(logfd);
+		if (ctl->sockfd > 0) close(ctl->sockfd);
 		exit(severity);
 	}
 }
 
+/**********/
+/* LOGPUT */
+/**********/
+void logput(const char * text, int len) {
+// Add text to the log buffer, writing the buffer out first if it won't fit
+	if (loglen + len > LOGBUF) logflush();
+	if (loglen == 0) logdue = msNow() + LOGFLUSH;
+	memcpy(logbuf + loglen, text, len);
+	loglen += len;
+}
+
+/************/
+/* LOGFLUSH */
+/************/
+void logflush(void) {
+// Write out the log buffer, rotating the file if it has grown past logmax.
+// If the write fails the lines are lost: there is nowhere to report it.
+	int n, done = 0;
+	char oldname[sizeof(logname) + 2];
+	
+	while (logfd >= 0 && done < loglen) {
+		n = write(logfd, logbuf + done, loglen - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+	loglen = 0;
+	logsize += done;
+	if (logfd >= 0 && logmax && logsize > logmax) {
+		sprintf(oldname, "%s.1", logname);
+		rename(logname, oldname);
+		close(logfd);
+		logfd = open(logname, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+		logsize = 0;
+	}
+}
+
 // Static data
-struct termios oldSettings, newSettings; 
+struct termios oldSettings, newSettings; 	// oldSettings is saved per line by openLine
 
 /**************/
 /* OPENSERIAL */
@@ -303,9 +1108,6 @@ int openSerial(const char * name, int baud, int parity, int databits, int stopbi
 /* open serial device; return file descriptor or -1 for error (see errno) */
 	int fd, res;
 	
-	if (strchr(name, ':')) 
-		return openSocket(name);
-	
 	if ((fd = open(name, O_RDWR | O_NOCTTY)) < 0) return fd;	// an error code
 	
 	tcgetattr(fd, &oldSettings);
@@ -323,393 +1125,2594 @@ int openSerial(const char * name, int baud, int parity, int databits, int stopbi
 	tcflush(fd, TCIFLUSH);		// discard pending data
  	if (cfsetspeed(&newSettings, baud))
 		perror("Setting serial port");
-	if((res = tcsetattr(fd, TCSANOW, &newSettings)) < 0) {
+	if((res = tcsetattr(fd, TCSANOW, &newSettings)) < 0 && errno != ENOTTY) {	// /dev/null will do for replaying a trace
 		close(fd);	// if there's an error setting values, return the error code
 		return res;
 	}
 	return fd;
 }
 
-/**************/
-/* OPENSOCKET */
-/**************/
-// Return an open fd or -1 for error
+/******************/
+/* RESOLVENETPORT */
+/******************/
+// Return 0 once l->addr holds the address, 1 for a logged failure
 // Expects name to be hostname:portname where either can be a name or numeric.
-// Need to avoid overwriting/alterng input string in case of re-use
-int openSocket(char * fullname) {
+// A numeric address needs no lookup; a hostname is looked up with gethostbyname,
+// which can block, so it is only done until it first succeeds.
+int resolveNetport(struct line * l) {
 	char * portname;
 	char name[64];
-	int fd;
-	struct sockaddr_in serv_addr;
+#ifndef SMALL
     struct hostent *server;
+#endif
 	struct servent * portent;
 	int port;
-	int firstime = 1;
 	
-	portname = strchr(fullname, ':');
-	if (!portname) return -1;	// No colon in hostname:portname
-	if (portname - fullname > 64) {
-		sprintf(buffer, "ERROR " PROGNAME " port name is too long: '%s", fullname);
+	portname = strchr(l->name, ':');
+	if (portname - l->name >= 64) {
+		sprintf(buffer, "ERROR " PROGNAME " port name is too long: '%s", l->name);
 		logmsg(ERROR, buffer);
-		return -1;
+		return 1;
 	}
-	strncpy(name, fullname, portname - fullname);
-	name[portname - fullname] = 0;
+	strncpy(name, l->name, portname - l->name);
+	name[portname - l->name] = 0;
 	portname++;		// Now portname point to port part and name is just host part.
 	
-	server = gethostbyname(name);
-	if (!server) {
-		sprintf(buffer,"ERROR " PROGNAME " Cannot resolve hostname %s", name);
-		logmsg(ERROR, buffer);	// Won't return
-		return -1;
+	bzero((char *) &l->addr, sizeof(l->addr));
+	l->addr.sin_family = AF_INET;
+	if (!inet_aton(name, &l->addr.sin_addr)) {
+#ifdef SMALL
+		sprintf(buffer, "ERROR " PROGNAME " %s needs a numeric address in this build", l->name);
+		logmsg(ERROR, buffer);
+		return 1;
+#else
+		server = gethostbyname(name);
+		if (!server) {
+			sprintf(buffer,"WARN " PROGNAME " Cannot resolve hostname %s", name);
+			logmsg(WARN, buffer);
+			return 1;
+		}
+		bcopy((char *)server->h_addr, 
+			  (char *)&l->addr.sin_addr.s_addr,
+			  server->h_length);
+#endif
 	}
-	bzero((char *) &serv_addr, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	bcopy((char *)server->h_addr, 
-		  (char *)&serv_addr.sin_addr.s_addr,
-		  server->h_length);
 	port = atoi(portname);		// Try it as a number first
 	if (!port) {
+#ifdef SMALL
+		portent = NULL;
+#else
 		portent = getservbyname(portname, "tcp");
+#endif
 		if (portent == NULL) {
 			sprintf(buffer,"ERROR " PROGNAME " Can't resolve port: %s", portname);
 			logmsg(ERROR, buffer);	// Won't return
-			return -1;
+			return 1;
 		}
-		serv_addr.sin_port = portent->s_port;
+		l->addr.sin_port = portent->s_port;
 	}
 	else
-		serv_addr.sin_port = htons(port);
-		
-	DEBUG fprintf(stderr, "Connect to %s:%d ", name, ntohs(serv_addr.sin_port));
-	fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0) {
-		sprintf(buffer, "ERROR " PROGNAME " Can't create socket: %s", strerror(errno));
-		logmsg(ERROR, buffer);		// Won't return
-		return -1;
-	}
-	DEBUG fprintf(stderr, "About to connect on %d ..", fd);
-	// If we can't connect due to timeout (far end not ready) keep trying forever
-	while (connect(fd, (struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0) {
-		DEBUG fprintf(stderr, "Connect fd%d ... sin_family %d sin_port %d sin_addr 0x%x ", fd, 
-					  serv_addr.sin_family, serv_addr.sin_port, serv_addr.sin_addr.s_addr);
-		if (firstime && errno == ETIMEDOUT) {
-			firstime = 0;
-			sprintf(buffer,"WARN " PROGNAME " Error connecting to remote serial %s - will keep trying %d (%s)", 
-					fullname, errno, strerror(errno));
-			logmsg(WARN, buffer);
-		}
-		
-		if (errno != ETIMEDOUT) {
-			sprintf(buffer,"WARN " PROGNAME " Error other than time out connecting to remote serial: %s", strerror(errno));
-			logmsg(WARN, buffer);
-			sleep(60);
-		}
-		if (errno == ETIMEDOUT) {
-			fd = close(fd);		// necessary in order to reuse file desciptors.
-			if (fd < 0){
-				sprintf(buffer, "WARN " PROGNAME " Can't close socket: %s", strerror(errno));
-				logmsg(WARN, buffer);		// Won't return
-				return -1;
-			}
-			fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (fd < 0) {
-				sprintf(buffer, "WARN " PROGNAME " Can't create socket after closing: %s", strerror(errno));
-				logmsg(WARN, buffer);		// Won't return
-				return -1;
-			}
-		}
-	}
-	DEBUG fprintf(stderr, "Connected on FD%d\n", fd);
-	return fd;
+		l->addr.sin_port = htons(port);
+	DEBUG fprintf(stderr, "Netport %s is %s:%d ", l->name, inet_ntoa(l->addr.sin_addr), ntohs(l->addr.sin_port));
+	return 0;
 }
 
 /***************/
-/* CLOSESERIAL */
+/* LINECONNECT */
 /***************/
-void closeSerial(int fd) {
-// Restore old serial port settings
-	tcsetattr(fd, TCSANOW, &oldSettings);
-	close(fd);
+void lineConnect(struct line * l) {
+// Start a non-blocking connect to a netport.  lineEvent finishes it when the socket 
+// becomes writable; lineTimer gives up on it after CONNECTTIMEOUT.  The socket is set up
+// for low latency and dead peer detection first, so the options hold from the start.
+	struct epoll_event ev;
+	int one, opt;
+	
+	if (!l->addr.sin_port && resolveNetport(l)) {
+		l->warned = 1;		// resolveNetport has said why
+		lineDown(l, 0);
+		return;
+	}
+	l->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (l->fd < 0) {
+		lineDown(l, errno);
+		return;
+	}
+	one = 1;
+	setsockopt(l->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(l->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	opt = NETKEEPIDLE;
+	setsockopt(l->fd, IPPROTO_TCP, TCP_KEEPIDLE, &opt, sizeof(opt));
+	opt = NETKEEPINTVL;
+	setsockopt(l->fd, IPPROTO_TCP, TCP_KEEPINTVL, &opt, sizeof(opt));
+	opt = NETKEEPCNT;
+	setsockopt(l->fd, IPPROTO_TCP, TCP_KEEPCNT, &opt, sizeof(opt));
+	opt = NETUSERTIMEOUT;
+	setsockopt(l->fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &opt, sizeof(opt));
+	fcntl(l->fd, F_SETFL, O_NONBLOCK);
+	DEBUG fprintf(stderr, "About to connect on %d ..", l->fd);
+	l->retry = msNow();
+	if (connect(l->fd, (struct sockaddr *) &l->addr, sizeof(l->addr)) == 0) {
+		watch(l->fd, EV_LINE, l - lines);
+		lineUp(l);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		lineDown(l, errno);
+		return;
+	}
+	l->connecting = 1;
+	ev.events = EPOLLOUT;
+	ev.data.u64 = 0;
+	ev.data.u32 = EV_LINE << 16 | (l - lines);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, l->fd, &ev);
+}
+
+/**********/
+/* LINEUP */
+/**********/
+void lineUp(struct line * l) {
+// The netport has connected: go back to blocking writes and send whatever has queued up.
+// A write can only block for NETUSERTIMEOUT ms before a dead connection fails it.
+	struct epoll_event ev;
+	
+	fcntl(l->fd, F_SETFL, 0);
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.u32 = EV_LINE << 16 | (l - lines);
+	epoll_ctl(epfd, EPOLL_CTL_MOD, l->fd, &ev);
+	l->connecting = 0;
+	l->backoff = CONNECTMIN;
+	l->busy = 0;
+	DEBUG fprintf(stderr, "Connected on FD%d\n", l->fd);
+	if (l->warned) {
+		sprintf(buffer, "INFO " PROGNAME " Connected to remote serial %s", l->name);
+		logmsg(INFO, buffer);
+		l->warned = 0;
+	}
 }
 
 /************/
-/* SOCKSEND */
+/* LINEDOWN */
 /************/
-void sockSend(const char * msg) {
-// Send the string to the server.  May terminate the program if necessary
-	short int msglen, written;
-	int retries = NUMRETRIES;
+void lineDown(struct line * l, int err) {
+// The line could not be opened, the netport reached, or either has gone away.  Close it 
+// and pick a time for lineTimer to try again.  Only the first failure in a row is reported.
+// The wait is only reset by a reply or a netport connecting, so a device that opens but
+// then fails straight away is not reopened in a tight loop.  The exception is a netport
+// that had been connected for a while, most likely power cycled: it is tried again at once.
+	int wait, again;
+	char * what;
+	long long now = msNow();
 	
-	if(noserver) {	// shortcut when in test mode
-		puts(msg);
-		return;
+	again = l->netport && l->fd >= 0 && !l->connecting && now - l->retry >= CONNECTMIN;
+	if (l->connecting || (l->fd < 0 && l->netport)) what = "Error connecting to remote serial";
+	else if (l->fd < 0) what = "Error reopening serial/port";
+	else what = "Lost connection to";
+	if (l->fd >= 0) close(l->fd);
+	l->fd = -1;
+	l->connecting = 0;
+	l->npending = 0;
+	if (!l->warned) {
+		sprintf(buffer,"WARN " PROGNAME " %d %s %s: %s - will keep trying", 
+				l->owner->num, what, l->name, err ? strerror(err) : "end of file");
+		logmsg(WARN, buffer);
+		l->warned = 1;
 	}
+	if (l->backoff < CONNECTMIN) l->backoff = CONNECTMIN;
+	wait = again ? 0 : l->backoff - random() % (l->backoff / 2);
+	l->retry = now + wait;
+	l->backoff *= 2;
+	if (l->backoff > CONNECTMAX) l->backoff = CONNECTMAX;
+	DEBUG fprintf(stderr, "Line %s retry in %d ms ", l->name, wait);
+}
 
-	msglen = strlen(msg);
-	written = htons(msglen);
-
-	if (write(sockfd, &written, 2) != 2) { // Can't even send length ??
-		sockfd = 0;		// prevent logmsg trying to write to socket!
-		logmsg(ERROR, "ERROR " PROGNAME " Can't write a length to socket");
-	}
-	while ((written = write(sockfd, msg, msglen)) < msglen) {
-		// not all written at first go
-			msg += written; msglen =- written;
-			printf("Only wrote %d; %d left \n", written, msglen);
-			if (--retries == 0) {
-				logmsg(WARN, "WARN " PROGNAME " Timed out writing to server"); 
-				return;
-			}
-			usleep(RETRYDELAY);
+/*************/
+/* LINETIMER */
+/*************/
+int lineTimer(struct line * l) {
+// Do whatever has fallen due on a line: connect attempts, reply timeouts and sending.
+// Return the ms until something else will be due, or -1 if nothing will.
+	int wait, n;
+	long long now = msNow();
+	
+	if (l->fd < 0) {
+		if (now < l->retry) return l->retry - now;
+		if (!l->netport) reopenLine(l);
+		else {
+			l->reopens++;
+			lineConnect(l);
+		}
+		if (l->fd < 0) return l->retry - now;
+	}
+	if (l->connecting) {
+		if (now - l->retry < CONNECTTIMEOUT) return l->retry + CONNECTTIMEOUT - now;
+		lineDown(l, ETIMEDOUT);
+		return l->retry - now;
 	}
+	if (refresh && now >= l->refreshdue) {
+		refreshLine(l);
+		l->refreshdue = now + refresh;
+	}
+	ackTimeout(l);
+	wait = pump(l);
+	n = ackTimeout(l);		// again, for the frames pump has just sent
+	if (n >= 0 && (wait < 0 || n < wait)) wait = n;
+	if (refresh && (wait < 0 || l->refreshdue - now < wait)) wait = l->refreshdue - now;
+	return wait;
 }
 
-/*****************/
-/* PROCESSSOCKET */
-/*****************/
-int processSocket(int fd, float factor){
-// Deal with commands from MCP.  Return to 0 to do a shutdown
-	short int msglen, numread;
-	char buffer[32], buffer2[192];	// about 128 is good but rather excessive since longest message is 'truncate'
-	char * cp = &buffer[0];
-	int retries = NUMRETRIES;
-	int n;
-	float val;
-		
-	if (read(sockfd, &msglen, 2) != 2) {
-		logmsg(WARN, "WARN " PROGNAME " Failed to read length from socket");
-		return 1;
-	}
-	msglen =  ntohs(msglen);
-	while ((numread = read(sockfd, cp, msglen)) < msglen) {
-		cp += numread;
-		msglen -= numread;
-		if (--retries == 0) {
-			logmsg(WARN, "WARN " PROGNAME " Timed out reading from server");
-			return 1;
+/***************/
+/* REFRESHLINE */
+/***************/
+void refreshLine(struct line * l) {
+// Queue the latest value of every display on the line again, so that one which has been
+// power cycled, or has missed a frame that never came back to be retried, catches up
+	struct controller * c;
+	int d;
+	long long now = msNow();
+	
+	for (c = controllers; c < controllers + numcontrollers; c++) {
+		if (c->line != l) continue;
+		for (d = 1; d <= NUMDISPLAYS; d++) {
+			if (c->slot[d].f.s.N != 'N' || c->slot[d].queued) continue;
+			c->slot[d].queued = now;
+			c->slot[d].o.rcvd = now;
+			c->slot[d].o.tries = RETRANSMIT;	// there will be another chance
+			c->count[d].refreshed++;
+			l->count.refreshed++;
 		}
-		usleep(RETRYDELAY);
 	}
-	cp[numread] = '\0';	// terminate the buffer 
+}
+
+/*************/
+/* LINEEVENT */
+/*************/
+void lineEvent(struct line * l, int events) {
+// Deal with epoll reporting a line: either a connect has finished or there are replies
+	int err = 0;
+	socklen_t len = sizeof(err);
 	
-	if (strcmp(buffer, "exit") == 0)
-		return 0;	// Terminate program
-	if (strcmp(buffer, "Ok") == 0)
-		return 1;	// Just acknowledgement
-	if (strcmp(buffer, "truncate") == 0) {
-		if (logfp) {
-		// ftruncate(logfp, 0L);
-		// lseek(logfp, 0L, SEEK_SET);
-			freopen(NULL, "w", logfp);
-			logmsg(INFO, "INFO " PROGNAME " Truncated log file");
-		} else
-			logmsg(INFO, "INFO " PROGNAME " Log file not truncated as it is not open");
-		return 1;
-	}
-	if (strcmp(buffer, "debug 0") == 0) {	// turn off debug
-		debug = 0;
-		return 1;
-	}
-	if (strcmp(buffer, "debug 1") == 0) {	// enable debugging
-		debug = 1;
-		return 1;
+	if (l->fd < 0) return;
+	if (l->connecting) {
+		if (getsockopt(l->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+		if (err) lineDown(l, err);
+		else lineUp(l);
+		return;
 	}
-	if (strcmp(buffer, "debug 2") == 0) {	// enable debugging
-		debug = 2;
-		return 1;
+	readReply(l);
+}
+
+/**********/
+/* QUEUED */
+/**********/
+int queued(struct line * l) {
+// Return the number of frames waiting to be sent on a line
+	struct controller * c;
+	int d, n = 0;
+	for (c = controllers; c < controllers + numcontrollers; c++)
+		if (c->line == l)
+			for (d = 1; d <= NUMDISPLAYS; d++) if (c->slot[d].queued) n++;
+	return n;
+}
+
+/************/
+/* OPENLINE */
+/************/
+struct line * openLine(char * name, int baud) {
+// Return the line for a device, opening it unless another controller already has.
+// As the main loop watches it, failure to open the device is fatal.
+	struct line * l;
+	
+	for (l = lines; l < lines + numlines; l++)
+		if (strcmp(l->name, name) == 0) return l;
+	if (numlines == MAXLINES) {
+		sprintf(buffer, "FATAL " PROGNAME " Too many lines: at most %d", MAXLINES);
+		logmsg(FATAL, buffer);
 	}
-	if (strcmp(buffer, "help") == 0) {
-		strcpy(buffer2, "INFO Commands are: debug 0|1, exit, truncate, kw or kwh or disp N val [places]");
-		logmsg(INFO, buffer2);
-		return 1;
+	l = &lines[numlines];
+	bzero(l, sizeof(*l));
+	l->name = name;
+	l->baud = baud;
+	l->frametime = frameTime(baud);
+	l->ato = ACKTIMEOUT;
+	l->refreshdue = msNow() + refresh;
+	l->owner = ctl;
+	if (strchr(name, ':')) {		// a netport: connect in the background
+		l->netport = 1;
+		l->fd = -1;
+		numlines++;
+		lineConnect(l);
+		return l;
 	}
-	if (strncmp(buffer, "w ", 2) == 0) {
-		n = sscanf(buffer+1, "%f", &val);
-		if (n != 1) {
-			logmsg(WARN, "WARN " PROGNAME " failed to get w (watts) value");
-			return 1;
-		}
-		ricosend(fd, 3, val * 1000.0, 0);	// Send watts to display 3, with 3 decimal places
-		return 1;
+	if ((l->fd = openSerial(name, baud, 0, CS8, 1)) < 0) {
+		sprintf(buffer, "ERROR " PROGNAME " %d Failed to open %s: %s", ctl->num, name, strerror(errno));
+#ifdef DEBUGCOMMS
+		logmsg(INFO, buffer);			// FIXME AFTER TEST
+		printf("Using stdio\n");
+		l->fd = 0;		// use stdin
+#else
+		logmsg(FATAL, buffer);
+#endif
 	}
-	if (strncmp(buffer, "kw ", 3) == 0) {
-		n = sscanf(buffer+2, "%f", &val);
-		if (n != 1) {
-			logmsg(WARN, "WARN " PROGNAME " failed to get kw value");
-			return 1;
-		}
-		if (watts)
-			ricosend(fd, 3, val * 1000.0, 0);
-		else				
-			ricosend(fd, 3, val, 3);	// Send kw to display 3, with 3 decimal places
-		return 1;
+	l->oldSettings = oldSettings;
+	if (flock(l->fd, LOCK_EX | LOCK_NB) == -1) {
+		sprintf(buffer, "FATAL " PROGNAME " is already running, cannot start another one on %s", name);
+		logmsg(FATAL, buffer);
 	}
-	if (strncmp(buffer, "kwh ", 4) == 0) {
-		n = sscanf(buffer+3, "%f", &val);
-		if (n != 1) {
-			logmsg(WARN, "WARN " PROGNAME " failed to get kwh value");
+	watch(l->fd, EV_LINE, numlines);
+	numlines++;
+	return l;
+}
+
+/***************/
+/* CLOSESERIAL */
+/***************/
+void closeSerial(struct line * l) {
+// Restore old serial port settings
+	if (l->fd < 0) return;
+	if (!l->netport) tcsetattr(l->fd, TCSANOW, &l->oldSettings);
+	close(l->fd);
+}
+
+/**************/
+/* MCPCONNECT */
+/**************/
+void mcpConnect(struct controller * c) {
+// Start a non-blocking connect to the MCP on localhost.  mcpEvent finishes it.
+	static struct sockaddr_in serv_addr;
+#ifndef SMALL
+	struct hostent *server;
+#endif
+	struct epoll_event ev;
+	
+#ifdef SMALL
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	serv_addr.sin_port = htons(PORTNO);
+#else
+	if (!serv_addr.sin_port) {		// only look it up once
+		server = gethostbyname("localhost");
+		if (server == NULL) {
+			logmsg(FATAL, "FATAL " PROGNAME " Cannot resolve localhost");
+		}
+		serv_addr.sin_family = AF_INET;
+		bcopy((char *)server->h_addr, 
+			 (char *)&serv_addr.sin_addr.s_addr,
+			 server->h_length);
+		serv_addr.sin_port = htons(PORTNO);
+	}
+#endif
+	c->sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (c->sockfd < 0) 
+		logmsg(FATAL, "FATAL " PROGNAME " Creating socket");
+	fcntl(c->sockfd, F_SETFL, O_NONBLOCK);
+	c->retry = msNow();
+	if (connect(c->sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0 && errno != EINPROGRESS) {
+		mcpDown(c, errno);
+		return;
+	}
+	c->connecting = 1;		// even if it has already: mcpEvent will hear it is writable
+	c->waitout = 1;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.u64 = 0;
+	ev.data.u32 = EV_MCP << 16 | (c - controllers);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->sockfd, &ev);
+}
+
+/*********/
+/* MCPUP */
+/*********/
+void mcpUp(struct controller * c) {
+// Connected to the MCP.  Log on ahead of whatever was queued while it was away.
+	char logon[80];
+	int n;
+	
+	c->connecting = 0;
+	c->up = 1;
+	c->backoff = MCPRETRYMIN;
+	// The end of a message cut off by the old connection would make no sense on this one
+	c->txlen -= c->txskip;
+	memmove(c->tx, c->tx + c->txskip, c->txlen);
+	c->txskip = 0;
+	n = sprintf(logon + 2, "logon rico %s %d %d", getversion(), getpid(), c->num);
+	if (c->txlen + 2 + n > MCPTXBUF) {		// no room left: start afresh
+		c->dropped += c->txlen > 0;
+		c->txlen = 0;
+	}
+	logon[0] = n >> 8;
+	logon[1] = n & 0xff;
+	memmove(c->tx + 2 + n, c->tx, c->txlen);
+	memcpy(c->tx, logon, 2 + n);
+	c->txlen += 2 + n;
+	DEBUG fprintf(stderr, "Connected to MCP on FD%d ", c->sockfd);
+	if (c->warned) {
+		c->warned = 0;
+		ctl = c;
+		sprintf(buffer, "INFO " PROGNAME " %d Reconnected to server", c->num);
+		logmsg(INFO, buffer);
+	}
+	mcpFlush(c);
+}
+
+/***********/
+/* MCPDOWN */
+/***********/
+void mcpDown(struct controller * c, int err) {
+// The MCP could not be reached or has gone away.  Keep going without it and try again
+// soon.  Anything not yet written stays queued for the next connection.
+	int wait, was = c->up;
+	
+	if (c->sockfd >= 0) close(c->sockfd);
+	c->sockfd = -1;
+	c->connecting = 0;
+	c->up = 0;
+	c->waitout = 0;
+	c->rxlen = 0;
+	c->skip = 0;
+	if (c->backoff < MCPRETRYMIN) c->backoff = MCPRETRYMIN;
+	wait = c->backoff - random() % (c->backoff / 2);
+	c->retry = msNow() + wait;
+	c->backoff *= 2;
+	if (c->backoff > MCPRETRYMAX) c->backoff = MCPRETRYMAX;
+	DEBUG fprintf(stderr, "MCP retry in %d ms ", wait);
+	if (!c->warned) {
+		c->warned = 1;
+		ctl = c;
+		sprintf(buffer, "WARN " PROGNAME " %d %s server: %s", c->num, was ? "Lost connection to" : "Cannot connect to",
+			err ? strerror(err) : "end of file");
+		logmsg(WARN, buffer);		// queued for when it is back
+	}
+}
+
+/************/
+/* MCPTIMER */
+/************/
+int mcpTimer(struct controller * c) {
+// Reconnect to the MCP if it is time to.  Return ms until the next attempt, or -1 if none is due.
+	long long now = msNow();
+	
+	if (c->sockfd < 0) {
+		if (now < c->retry) return c->retry - now;
+		mcpConnect(c);
+		if (c->sockfd < 0) return c->retry - now;
+	}
+	if (c->connecting) {
+		if (now - c->retry < CONNECTTIMEOUT) return c->retry + CONNECTTIMEOUT - now;
+		mcpDown(c, ETIMEDOUT);
+		return c->retry - now;
+	}
+	return -1;
+}
+
+/************/
+/* MCPEVENT */
+/************/
+int mcpEvent(struct controller * c, int events, long long factor) {
+// Deal with epoll reporting the MCP socket.  Return 0 if the server wants us to exit.
+	int err = 0;
+	socklen_t len = sizeof(err);
+	
+	if (c->sockfd < 0) return 1;
+	if (c->connecting) {
+		if (getsockopt(c->sockfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+		if (err) mcpDown(c, err);
+		else mcpUp(c);
+		return 1;
+	}
+	if (events & EPOLLOUT) mcpFlush(c);
+	if (c->sockfd < 0 || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return 1;
+	c->online = 1;
+	c->lastdata = msNow();
+	return processSocket(c, factor);
+}
+
+/*********/
+/* WATCH */
+/*********/
+void watch(int fd, int kind, int index) {
+// Add a descriptor to the epoll set, tagged with what it is
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.u32 = kind << 16 | index;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EPERM) {	// EPERM: never ready, like /dev/null
+		sprintf(buffer, "WARN " PROGNAME " Can't watch fd %d: %s", fd, strerror(errno));
+		logmsg(WARN, buffer);
+	}
+}
+
+/************/
+/* SOCKSEND */
+/************/
+void sockSend(const char * msg) {
+// Send the string to the server.
+// Never waits: whatever the socket won't take now is queued for mcpFlush, which the main
+// loop calls when it becomes writable, or which mcpUp calls once the server is back.  When the queue is backing up INFO events are 
+// dropped, and if it is full anything is.  The server is told how many once it catches up.
+	struct controller * c = ctl;
+	unsigned short msglen, netlen;
+	int written;
+	struct iovec iov[2];
+	
+	if(noserver) {	// shortcut when in test mode
+		iov[0].iov_base = (char *) msg;
+		iov[0].iov_len = strlen(msg);
+		iov[1].iov_base = "\n";
+		iov[1].iov_len = 1;
+		written = writev(1, iov, 2);
+		return;
+	}
+	if (c->sockfd == 0) return;		// not using one
+
+	msglen = strlen(msg);
+	if (c->txlen + 2 + msglen > MCPTXBUF || (c->txlen > MCPTXLOW && strncmp(msg, "event INFO", 10) == 0)) {
+		c->dropped++;
+		return;
+	}
+	netlen = htons(msglen);
+	written = 0;
+	if (c->txlen == 0 && c->up) {	// nothing ahead of it, so try to send it straight away
+		iov[0].iov_base = &netlen;
+		iov[0].iov_len = 2;
+		iov[1].iov_base = (char *) msg;
+		iov[1].iov_len = msglen;
+		while ((written = writev(c->sockfd, iov, 2)) < 0 && errno == EINTR);
+		if (written < 0) {
+			if (errno != EAGAIN) mcpDown(c, errno);		// may queue a warning itself
+			written = 0;
+		}
+		if (written == 2 + msglen) return;
+		if (written) c->txskip = 2 + msglen - written;
+		if (c->txlen + 2 + msglen - written > MCPTXBUF) {	// the warning took the room
+			c->dropped++;
+			return;
+		}
+	}
+	// Queue what is left
+	if (written < 2) {
+		memcpy(c->tx + c->txlen, (char *) &netlen + written, 2 - written);
+		c->txlen += 2 - written;
+		written = 2;
+	}
+	memcpy(c->tx + c->txlen, msg + written - 2, msglen + 2 - written);
+	c->txlen += msglen + 2 - written;
+	if (c->up) watchOut(c, 1);
+}
+
+/************/
+/* MCPFLUSH */
+/************/
+void mcpFlush(struct controller * c) {
+// Write as much of the queue as the socket will take
+	int written, n;
+	
+	if (!c->up) return;
+	if (c->txlen) {
+		while ((written = write(c->sockfd, c->tx, c->txlen)) < 0 && errno == EINTR);
+		if (written < 0) {
+			if (errno != EAGAIN) mcpDown(c, errno);
+			return;
+		}
+		// Find where that left off, in case the rest has to go on another connection
+		for (n = c->txskip; n < written; n += 2 + ((unsigned char) c->tx[n] << 8 | (unsigned char) c->tx[n + 1]));
+		c->txskip = n - written;
+		c->txlen -= written;
+		memmove(c->tx, c->tx + written, c->txlen);
+		if (c->txlen) return;
+	}
+	watchOut(c, 0);
+	if (c->dropped) {
+		sprintf(buffer, "event WARN " PROGNAME " %d Dropped %d messages to server", c->num, c->dropped);
+		c->dropped = 0;
+		ctl = c;
+		sockSend(buffer);
+	}
+}
+
+/************/
+/* WATCHOUT */
+/************/
+void watchOut(struct controller * c, int on) {
+// Ask epoll to report when the socket can be written, or stop asking
+	struct epoll_event ev;
+	if (c->waitout == on) return;
+	ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.u64 = 0;
+	ev.data.u32 = EV_MCP << 16 | (c - controllers);
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->sockfd, &ev);
+	c->waitout = on;
+}
+
+/*****************/
+/* PROCESSSOCKET */
+/*****************/
+int processSocket(struct controller * c, long long factor){
+// Deal with commands from MCP.  Return to 0 to do a shutdown
+// Reads whatever has arrived and acts on every complete message in it.  A partial
+// message is kept in c->rx until the rest turns up on a later call.
+	int n;
+	
+	n = read(c->sockfd, c->rx + c->rxlen, sizeof(c->rx) - 1 - c->rxlen);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 1;
+	if (n <= 0) {
+		mcpDown(c, n ? errno : 0);
+		return 1;
+	}
+	c->rxlen += n;
+	return takeMessages(c, NULL, c->rx, &c->rxlen, &c->skip, factor);
+}
+
+/****************/
+/* TAKEMESSAGES */
+/****************/
+int takeMessages(struct controller * c, struct client * cl, unsigned char * rx, int * rxlen, int * skip, long long factor) {
+// Act on each complete length prefixed message in rx, from the MCP or, if cl is set, from a 
+// listen mode client.  Return 0 if one asks for a shutdown.  What is left in rx is moved up 
+// to the front: a partial message, or for a client the messages it has no allowance for yet.
+	int n, len, run = 1;
+	unsigned short msglen;
+	
+	while (run) {
+		if (*skip) {		// still discarding an oversize message
+			n = *skip < *rxlen ? *skip : *rxlen;
+			*skip -= n;
+			*rxlen -= n;
+			memmove(rx, rx + n, *rxlen);
+			if (*skip) break;
+		}
+		if (*rxlen < 2) break;
+		memcpy(&msglen, rx, 2);
+		len = ntohs(msglen);
+		if (len > MAXMSG) {
+			sprintf(buffer, "WARN " PROGNAME " %d Discarding message of %d bytes from %s", c->num, len, cl ? "client" : "server");
+			logmsg(WARN, buffer);
+			*skip = len;
+			*rxlen -= 2;
+			memmove(rx, rx + 2, *rxlen);
+			continue;
+		}
+		if (*rxlen < 2 + len) break;		// wait for the rest
+#ifndef SMALL
+		if (cl && !clientCredit(cl)) break;		// over its rate: leave it for clientTimer
+#endif
+		n = rx[2 + len];
+		rx[2 + len] = '\0';	// terminate the message
+#ifndef SMALL
+		if (cl) clientCommand(cl, (char *) rx + 2, len, factor);
+		else
+#endif
+		run = command(c, (char *) rx + 2, len, factor);
+		rx[2 + len] = n;
+		*rxlen -= 2 + len;
+		memmove(rx, rx + 2 + len, *rxlen);
+		if (cl) c = cl->c;		// it may have picked another controller
+	}
+	return run;
+}
+
+/***********/
+/* COMMAND */
+/***********/
+int command(struct controller * c, char * buffer, int len, long long factor) {
+// Act on one message from the MCP.  Return 0 to do a shutdown
+	char buffer2[MAXMSG + 64];
+	int n;
+	long long val;
+	
+#ifndef SMALL
+	trace(TR_MSG, c - controllers, buffer, len);
+#endif
+	if (len && buffer[0] == BATCHMARK) {	// binary disps
+		unsigned char * bp = (unsigned char *) buffer + 1;
+		long mant;
+		int scale;
+		if ((len - 1) % BATCHITEM) {
+			logmsg(WARN, "WARN " PROGNAME " binary display batch is not a whole number of items");
+			return 1;
+		}
+		for (n = 0; bp < (unsigned char *) buffer + len; bp += BATCHITEM) {
+			mant = (long) (int) ((unsigned) bp[3] << 24 | bp[4] << 16 | bp[5] << 8 | bp[6]);
+			for (val = mant * FIXONE, scale = bp[2]; scale > 0; scale--) val /= 10;
+			if (disp(c, bp[0], val, (signed char) bp[1]) == 0) n++;
+		}
+		burst(c, n);		// all on the wire together
+		return 1;
+	}
+	if (strcmp(buffer, "exit") == 0)
+		return 0;	// Terminate program
+	if (strcmp(buffer, "Ok") == 0)
+		return 1;	// Just acknowledgement
+	if (strcmp(buffer, "stats") == 0) {
+		stats(c, 1);
+		return 1;
+	}
+	if (strcmp(buffer, "truncate") == 0) {
+		if (logfd >= 0) {
+			loglen = 0;			// nothing waiting is wanted either
+			ftruncate(logfd, 0L);
+			logsize = 0;
+			logmsg(INFO, "INFO " PROGNAME " Truncated log file");
+		} else
+			logmsg(INFO, "INFO " PROGNAME " Log file not truncated as it is not open");
+		return 1;
+	}
+	if (strcmp(buffer, "debug 0") == 0) {	// turn off debug
+		debug = 0;
+		return 1;
+	}
+	if (strcmp(buffer, "debug 1") == 0) {	// enable debugging
+		debug = 1;
+		return 1;
+	}
+	if (strcmp(buffer, "debug 2") == 0) {	// enable debugging
+		debug = 2;
+		return 1;
+	}
+	if (strcmp(buffer, "help") == 0) {
+		// Two events, as logmsg would cut one short
+		strcpy(buffer2, "INFO Commands are: debug 0|1|2, exit, truncate, stats, kw or kwh or w val, disp N val [places], disps N val [places], N val [places] ...");
+		logmsg(INFO, buffer2);
+#ifndef SMALL
+		strcpy(buffer2, "INFO and sample N val, agg N off|mean|min|max|kw [secs [places]]");
+		logmsg(INFO, buffer2);
+#endif
+		return 1;
+	}
+	if (strncmp(buffer, "w ", 2) == 0) {
+		n = parseFixed(buffer+1, &val, NULL);
+		if (n != 1) {
+			logmsg(WARN, "WARN " PROGNAME " failed to get w (watts) value");
+			return 1;
+		}
+		route(c, ROUTE_W, val, 0);		// watts to display 3 unless routed elsewhere
+		return 1;
+	}
+	if (strncmp(buffer, "kw ", 3) == 0) {
+		n = parseFixed(buffer+2, &val, NULL);
+		if (n != 1) {
+			logmsg(WARN, "WARN " PROGNAME " failed to get kw value");
+			return 1;
+		}
+		route(c, ROUTE_KW, val, 3);		// kw to display 3, with 3 decimal places
+		return 1;
+	}
+	if (strncmp(buffer, "kwh ", 4) == 0) {
+		n = parseFixed(buffer+3, &val, NULL);
+		if (n != 1) {
+			logmsg(WARN, "WARN " PROGNAME " failed to get kwh value");
 			return 1;
 		}
-		ricosend(fd, 5, val, -1);		// send kwh to display 5 ... 
-		ricosend(fd, 8, val * factor, -1);	// and CO2 to display 8 
-					// with decimal place located automatically
-		return 1;
+		route(c, ROUTE_KWH, val, -1);	// kwh to display 5 and CO2 to display 8
+		return 1;
+	}
+	if (strncmp(buffer, "disp ", 5) == 0) {
+		int num, decimals;
+		decimals = 3;
+		n = scanDisp(buffer+5, &num, &val, &decimals);
+		if (n != 2 && n!= 3) {
+			logmsg(WARN, "WARN " PROGNAME " failed to get display number and value");
+			return 1;
+		}
+		disp(c, num, val, decimals);
+		return 1;
+	}
+#ifndef SMALL
+	if (strncmp(buffer, "sample ", 7) == 0) {
+		int num;
+		if (scanDisp(buffer+7, &num, &val, &n) < 2 || num < 1 || num > model->displays) {
+			logmsg(WARN, "WARN " PROGNAME " failed to get display number and sample");
+			return 1;
+		}
+		aggSample(c, num, val);
+		return 1;
+	}
+	if (strncmp(buffer, "agg ", 4) == 0) {
+		static const char * modes[] = {"off", "mean", "min", "max", "kw"};
+		char mode[8];
+		int num, seconds = AGGWINDOW, decimals = 3;
+		if (sscanf(buffer+4, "%d %7s %d %d", &num, mode, &seconds, &decimals) >= 2 && num >= 1 && num <= model->displays)
+			for (n = 0; n <= AGG_KW; n++)
+				if (strcmp(mode, modes[n]) == 0) {
+					aggSet(c, num, n, seconds, decimals);
+					return 1;
+				}
+		logmsg(WARN, "WARN " PROGNAME " agg needs display number and off, mean, min, max or kw");
+		return 1;
+	}
+#endif
+	if (strncmp(buffer, "disps ", 6) == 0) {	// several disp commands in one, comma separated
+		int num, decimals, count = 0;
+		char * cp;
+		for (cp = strtok(buffer + 6, ","); cp; cp = strtok(NULL, ",")) {
+			decimals = 3;
+			n = scanDisp(cp, &num, &val, &decimals);
+			if (n != 2 && n!= 3) {
+				logmsg(WARN, "WARN " PROGNAME " failed to get display number and value in disps");
+				continue;
+			}
+			if (disp(c, num, val, decimals) == 0) count++;
+		}
+		burst(c, count);		// all on the wire together
+		return 1;
+	}
+	strcpy(buffer2, "INFO " PROGNAME " Unknown message from server: ");
+	strcat(buffer2, buffer);
+	logmsg(INFO, buffer2);	// Risk of loop: sending unknown message straight back to server
+	
+	return 1;	
+};
+
+/********/
+/* DISP */
+/********/
+int disp(struct controller * c, int num, long long val, int decimals) {
+// Send value to specified display.  Return 1 if the display is out of range
+	if (num < 1 || num > model->displays) {
+		sprintf(buffer, "WARN " PROGNAME " Display is not in range 1 to %d: %d", model->displays, num);
+		logmsg(WARN, buffer);
+		return 1;
+	}
+	route(c, ROUTE_DISP + num, val, decimals);
+	return 0;
+}
+
+/************/
+/* SCANDISP */
+/************/
+int scanDisp(char * s, int * num, long long * val, int * decimals) {
+// Read "N val [places]", returning the number of fields converted as sscanf would
+	char * end;
+	int n;
+	*num = strtol(s, &end, 10);
+	if (end == s) return 0;
+	if (parseFixed(end, val, &s) == 0) return 1;
+	n = strtol(s, &end, 10);
+	if (end == s) return 2;
+	*decimals = n;
+	return 3;
+}
+
+/*********/
+/* ROUTE */
+/*********/
+void route(struct controller * c, int r, long long val, int decimals) {
+// Send a value to each display the route for its command lists
+	struct route * rt = &routes[r];
+	int i;
+	
+	for (i = 0; i < rt->n; i++)
+		ricosend(c, rt->to[i].display, rt->to[i].scale == FIXONE ? val : fixMul(val, rt->to[i].scale),
+			rt->to[i].decimals == ROUTEASIS ? decimals : rt->to[i].decimals);
+}
+
+/*****************/
+/* ROUTEDEFAULTS */
+/*****************/
+void routeDefaults(long long factor) {
+// Build the routes there were before the routing file: kw to display 3 (as watts with -w),
+// kwh to 5 and CO2 to 8, w to 3, and disp as it says, except that with -w display 2 is 
+// taken as kw and shown as watts - frig for Ecotech since MCP doesn't send kw.
+// A model with fewer displays only gets the routes to the ones it has.
+	struct route * rt = routetab[0];
+	int d, r, i, n;
+	
+	rt[ROUTE_KW].n = 1;
+	rt[ROUTE_KW].to[0].display = 3;
+	rt[ROUTE_KW].to[0].scale = watts ? 1000 * FIXONE : FIXONE;
+	rt[ROUTE_KW].to[0].decimals = watts ? 0 : 3;
+	rt[ROUTE_KWH].n = 2;
+	rt[ROUTE_KWH].to[0].display = 5;
+	rt[ROUTE_KWH].to[0].scale = FIXONE;
+	rt[ROUTE_KWH].to[0].decimals = -1;
+	rt[ROUTE_KWH].to[1].display = 8;
+	rt[ROUTE_KWH].to[1].scale = factor;
+	rt[ROUTE_KWH].to[1].decimals = -1;
+	rt[ROUTE_W].n = 1;
+	rt[ROUTE_W].to[0].display = 3;
+	rt[ROUTE_W].to[0].scale = 1000 * FIXONE;
+	rt[ROUTE_W].to[0].decimals = 0;
+	for (d = 1; d <= NUMDISPLAYS; d++) {
+		rt[ROUTE_DISP + d].n = 1;
+		rt[ROUTE_DISP + d].to[0].display = d;
+		rt[ROUTE_DISP + d].to[0].scale = FIXONE;
+		rt[ROUTE_DISP + d].to[0].decimals = ROUTEASIS;
+	}
+	if (watts) {
+		rt[ROUTE_DISP + 2].to[0].scale = 1000 * FIXONE;
+		rt[ROUTE_DISP + 2].to[0].decimals = 3;
+	}
+	for (r = 0; r < ROUTES; r++) {
+		for (i = n = 0; i < rt[r].n; i++)
+			if (rt[r].to[i].display <= model->displays) rt[r].to[n++] = rt[r].to[i];
+		rt[r].n = n;
+	}
+}
+
+/*************/
+/* ROUTELOAD */
+/*************/
+void routeLoad(void) {
+// Read the routing file into whichever table is not in use, starting from the defaults, 
+// and switch to it.  A command in the file replaces all of its default routes.  If the 
+// file can't be read or has a mistake in it the routes stay as they were.
+	struct route * rt = routes == routetab[1] ? routetab[2] : routetab[1];
+	char text[ROUTEFILEMAX + 1], cmd[16], scale[32], places[16], * line, * next;
+	int r, fd, len, lineno = 0, display, seen[ROUTES];
+	long long sc;
+	
+	if ((fd = open(routefile, O_RDONLY)) < 0 || (len = read(fd, text, sizeof(text))) < 0 || len == sizeof(text)) {
+		sprintf(buffer, "WARN " PROGNAME " %d Can't read routes from %s: %s", ctl->num, routefile, 
+			fd >= 0 && len == sizeof(text) ? "too long" : strerror(errno));
+		logmsg(WARN, buffer);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	close(fd);
+	text[len] = '\0';
+	memcpy(rt, routetab[0], sizeof(routetab[0]));
+	bzero(seen, sizeof(seen));
+	for (line = text; line && *line; line = next) {
+		if ((next = strchr(line, '\n'))) *next++ = '\0';
+		lineno++;
+		if ((r = sscanf(line, "%15s %d %31s %15s", cmd, &display, scale, places)) <= 0 || cmd[0] == '#') continue;
+		if (r < 4 && !(r == 2 && display == 0)) break;
+		if (strcmp(cmd, "kw") == 0) r = ROUTE_KW;
+		else if (strcmp(cmd, "kwh") == 0) r = ROUTE_KWH;
+		else if (strcmp(cmd, "w") == 0) r = ROUTE_W;
+		else if (strncmp(cmd, "disp", 4) == 0 && cmd[4] >= '1' && cmd[4] <= '0' + model->displays && !cmd[5]) 
+			r = ROUTE_DISP + cmd[4] - '0';
+		else break;
+		if (!seen[r]) rt[r].n = 0;		// forget the defaults
+		seen[r] = 1;
+		if (display == 0) continue;		// nowhere
+		if (rt[r].n == ROUTEMAX || display < 0 || display > model->displays || parseFixed(scale, &sc, NULL) != 1
+			|| (strcmp(places, "auto") && strcmp(places, "-") && (places[0] < '0' || places[0] > '9'))) break;
+		rt[r].to[rt[r].n].display = display;
+		rt[r].to[rt[r].n].scale = sc;
+		rt[r].to[rt[r].n].decimals = strcmp(places, "auto") == 0 ? -1 : strcmp(places, "-") == 0 ? ROUTEASIS : atoi(places);
+		rt[r].n++;
+	}
+	if (line && *line) {		// stopped at a mistake
+		sprintf(buffer, "WARN " PROGNAME " %d Routes not changed: %s line %d is wrong", ctl->num, routefile, lineno);
+		logmsg(WARN, buffer);
+	} else {
+		routes = rt;		// all of it at once
+		sprintf(buffer, "INFO " PROGNAME " %d Routes read from %s", ctl->num, routefile);
+		logmsg(INFO, buffer);
+	}
+}
+
+/**************/
+/* ROUTEWATCH */
+/**************/
+void routeWatch(void) {
+// The first time, ask inotify about the routing file's directory: editors often write a
+// new file and rename it over the old one, which a watch on the file itself would miss.
+// After that, reload the routes whenever the file is among what has changed.
+	long buf[512];		// long for the alignment the events need
+	char dir[256], * base;
+	struct inotify_event * ev;
+	int n, changed = 0;
+	
+	base = strrchr(routefile, '/');
+	if (inotifyfd < 0) {
+		if (base) snprintf(dir, sizeof(dir), "%.*s", (int) (base - routefile) + 1, routefile);
+		else strcpy(dir, ".");
+		if ((inotifyfd = inotify_init1(IN_NONBLOCK)) < 0 || inotify_add_watch(inotifyfd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d Can't watch %s, use SIGHUP to reread it: %s", ctl->num, routefile, strerror(errno));
+			logmsg(WARN, buffer);
+			return;
+		}
+		watch(inotifyfd, EV_CONFIG, 0);
+		return;
+	}
+	base = base ? base + 1 : routefile;
+	while ((n = read(inotifyfd, buf, sizeof(buf))) > 0)
+		for (ev = (struct inotify_event *) buf; (char *) ev < (char *) buf + n; 
+			ev = (struct inotify_event *) ((char *) ev + sizeof(*ev) + ev->len))
+			if (ev->len && strcmp(ev->name, base) == 0) changed = 1;
+	if (changed) routeLoad();
+}
+
+#ifndef SMALL
+/*************/
+/* TRACEOPEN */
+/*************/
+void traceOpen(char * name) {
+// Start a new trace file.  Failure is only a warning.
+	if ((tracefd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0 
+		|| write(tracefd, TRACEMAGIC, 8) != 8) {
+		sprintf(buffer, "WARN " PROGNAME " %d Can't record a trace in %s: %s", ctl->num, name, strerror(errno));
+		logmsg(WARN, buffer);
+		if (tracefd >= 0) close(tracefd);
+		tracefd = -1;
+		return;
+	}
+	tracestart = msNow();
+}
+
+/*********/
+/* TRACE */
+/*********/
+void trace(int type, int index, const void * data, int len) {
+// Add a record to the trace buffer, writing the buffer out first if it won't fit.
+// With -j frames and replies are added by the line thread, so the buffer is locked.
+	struct tracerec r;
+	
+	if (tracefd < 0) return;
+	pthread_mutex_lock(&tracelock);
+	if (tracelen + sizeof(r) + len > TRACEBUF) traceWrite();
+	r.ms = msNow() - tracestart;
+	if (tracelen == 0) tracedue = tracestart + r.ms + LOGFLUSH;
+	r.type = type;
+	r.index = index;
+	r.len = len;
+	memcpy(tracebuf + tracelen, &r, sizeof(r));
+	memcpy(tracebuf + tracelen + sizeof(r), data, len);
+	tracelen += sizeof(r) + len;
+	pthread_mutex_unlock(&tracelock);
+}
+
+/**************/
+/* TRACEFLUSH */
+/**************/
+void traceFlush(void) {
+// Write out the trace buffer
+	pthread_mutex_lock(&tracelock);
+	traceWrite();
+	pthread_mutex_unlock(&tracelock);
+}
+
+/**************/
+/* TRACETIMER */
+/**************/
+int traceTimer(long long now) {
+// Write out the trace buffer if it has been waiting LOGFLUSH ms.  Return the ms until 
+// it will have been, or -1 if it is empty.
+	int wait = -1;
+	
+	pthread_mutex_lock(&tracelock);
+	if (tracelen && now >= tracedue) traceWrite();
+	else if (tracelen) wait = tracedue - now;
+	pthread_mutex_unlock(&tracelock);
+	return wait;
+}
+
+/**************/
+/* TRACEWRITE */
+/**************/
+void traceWrite(void) {
+// Write out the trace buffer, with tracelock held.  If that fails, stop tracing rather
+// than leave a gap.
+	int n, done = 0;
+	
+	while (tracefd >= 0 && done < tracelen) {
+		n = write(tracefd, tracebuf + done, tracelen - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d Trace stopped: %s", ctl->num, n ? strerror(errno) : "nothing written");
+			close(tracefd);
+			tracefd = -1;
+			logmsg(WARN, buffer);
+		}
+		else done += n;
+	}
+	tracelen = 0;
+}
+
+/**************/
+/* REPLAYOPEN */
+/**************/
+void replayOpen(char * name) {
+// Map a trace to play back.  Without one there is nothing to do.
+	struct stat st;
+	int fd;
+	
+	errno = 0;
+	if ((fd = open(name, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || st.st_size < 8
+		|| (replay = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED || memcmp(replay, TRACEMAGIC, 8)) {
+		sprintf(buffer, "ERROR " PROGNAME " %d %s is not a trace: %s", ctl->num, name, errno ? strerror(errno) : "bad header");
+		logmsg(ERROR, buffer);
+	}
+	close(fd);
+	replaylen = st.st_size;
+	replaypos = 8;
+	replaystart = msNow();
+}
+
+/***************/
+/* REPLAYTIMER */
+/***************/
+int replayTimer(long long factor) {
+// Act on the trace's messages that have come due, or the next REPLAYBATCH of them flat out.
+// Then, once the lines have sent what they have, report how long it took and shut down.
+// Return ms until there is more to do.
+	struct tracerec r;
+	struct controller * c;
+	struct line * l;
+	char msg[MAXMSG + 1];
+	long long now = msNow();
+	int n = 0;
+	
+	while (replaypos + sizeof(r) <= replaylen) {
+		memcpy(&r, replay + replaypos, sizeof(r));
+		if (replaypos + sizeof(r) + r.len > replaylen) break;	// cut short
+		if (replayspeed && replaystart + r.ms / replayspeed > now) return replaystart + r.ms / replayspeed - now;
+		if (!replayspeed && n == REPLAYBATCH) return 0;
+		replaypos += sizeof(r) + r.len;
+		if (r.type != TR_MSG || r.index >= numcontrollers || r.len > MAXMSG) continue;
+		memcpy(msg, replay + replaypos - r.len, r.len);
+		msg[r.len] = '\0';
+		ctl = &controllers[r.index];
+		command(ctl, msg, r.len, factor);		// but exit is left to the end of the trace
+		n++;
+		replayed++;
+	}
+	replaypos = replaylen;
+	if (!replayend) replayend = now;
+	if (threaded) {		// the lines are the line thread's: go by what it last reported
+		if ((nheld || __atomic_load_n(&updatesidle, __ATOMIC_ACQUIRE) != posted) && now - replayend < REPLAYDRAIN) return 100;
+	} else for (l = lines; l < lines + numlines; l++)
+		if ((queued(l) || l->npending) && now - replayend < REPLAYDRAIN) return 100;	// still going
+	ctl = &controllers[0];
+	sprintf(buffer, "INFO " PROGNAME " %d Played back %ld messages in %lld ms, lines done after %lld ms", 
+		ctl->num, replayed, replayend - replaystart, now - replaystart);
+	logmsg(INFO, buffer);
+	for (c = controllers; c < controllers + numcontrollers; c++) {
+		stats(c, c == c->line->owner);
+		c->active = 0;
+	}
+	replay = NULL;
+	return -1;
+}
+
+/********/
+/* BULK */
+/********/
+int bulk(struct controller * c, char * name, int pace, int decimals, int tmout, long long factor) {
+// Send the values in a file, or on stdin for "-", down a controller's line and give the line
+// up to tmout seconds after the last of them to finish.  Log and print a summary.  Return 
+// the exit status: 1 if a value could not be read, a frame failed or some were never sent.
+	struct line * l = c->line;
+	struct epoll_event ev[MAXEVENTS];
+	char in[BULKBUF + 1], msg[300], counts[300];
+	int fd, flags, pos = 0, len = 0, eof = 0, binary = -1, more, wait, n, i, k;
+	int wanted, watching = 0;	// waiting for input, and whether epoll is watching for it
+	long records = 0, bad = 0, taken, fresh;
+	long long start, end = 0, due, now;
+	
+	fd = strcmp(name, "-") ? open(name, O_RDONLY) : 0;
+	if (fd < 0) {
+		sprintf(buffer, "ERROR " PROGNAME " %d Can't read %s: %s", c->num, name, strerror(errno));
+		logmsg(ERROR, buffer);
+	}
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	start = due = msNow();
+	while (1) {
+		now = msNow();
+		more = wanted = 0;
+		taken = records;
+		while (!eof || pos < len) {
+			if (pace ? now < due : records - taken >= BULKBATCH) {
+				more = 1;
+				break;
+			}
+			k = bulkTake(c, in + pos, len - pos, eof || (pos == 0 && len == BULKBUF), &binary, decimals, &records, &bad);
+			if (k) {
+				pos += k;
+				if (pace && records > taken) due = now + pace;
+				continue;
+			}
+			memmove(in, in + pos, len - pos);	// make room and read some more
+			len -= pos;
+			pos = 0;
+			if ((k = read(fd, in + len, BULKBUF - len)) > 0) len += k;
+			else if (k < 0 && errno == EAGAIN) {		// epoll will say when there is more
+				wanted = 1;
+				break;
+			}
+			else if (k == 0 || errno != EINTR) {
+				if (k) {
+					sprintf(buffer, "WARN " PROGNAME " %d Reading %s: %s", c->num, name, strerror(errno));
+					logmsg(WARN, buffer);
+				}
+				eof = 1;
+			}
+		}
+		if (eof && pos == len && !end) end = msNow();
+		wait = lineTimer(l);
+		now = msNow();
+		if (end) {		// all taken: wait for the line to finish
+			if ((!queued(l) && !l->npending) || now - end >= tmout * 1000L) break;
+			i = end + tmout * 1000L - now;
+			if (wait < 0 || wait > i) wait = i;
+		} else if (more) {
+			i = pace ? due - now : 0;
+			if (wait < 0 || i < wait) wait = i;
+		}
+		// Only watch the input while waiting for it: a pipe that has been closed, or has data
+		// that isn't wanted yet, would otherwise wake epoll_wait over and over
+		if (wanted && !watching) watch(fd, EV_BULK, 0);		// never needed for a plain file
+		else if (!wanted && watching) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		watching = wanted;
+		if ((n = epoll_wait(epfd, ev, MAXEVENTS, wait)) < 0 && errno != EINTR) break;
+		for (i = 0; i < n; i++)
+			if (ev[i].data.u32 >> 16 == EV_LINE) lineEvent(l, ev[i].events);
+			else if (ev[i].data.u32 >> 16 == EV_MCP) mcpEvent(c, ev[i].events, factor);
+	}
+	if (watching) epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+	fcntl(fd, F_SETFL, flags);
+	if (fd) close(fd);
+	
+	// Values neither sent nor suppressed were replaced by later ones before the line had room.
+	// The summary goes to the log as three events, as it is too long for one.
+	fresh = l->count.sent - l->count.retries - l->count.refreshed;
+	k = queued(l);
+	now = msNow();
+	sprintf(msg, "INFO " PROGNAME " %d Bulk %.40s: %ld values (%ld bad) in %lld ms, %lld a second, %ld superseded, %d not sent", 
+		c->num, name, records, bad, now - start, records * 1000 / (now - start + 1), 
+		records - fresh - l->count.suppressed - k, k);
+	n = countsText(counts, &l->count);
+	counts[n++] = ' ';
+	latencyText(counts + n, &l->count);
+	fprintf(stderr, "%s, %s\n", msg + 5, counts);
+	logmsg(INFO, msg);
+	counts[n - 1] = '\0';
+	sprintf(msg, "INFO " PROGNAME " %d Bulk %.40s: %.200s", c->num, name, counts);
+	logmsg(INFO, msg);
+	sprintf(msg, "INFO " PROGNAME " %d Bulk %.40s: %.200s", c->num, name, counts + n);
+	logmsg(INFO, msg);
+	return bad || k || l->count.naked || l->count.timedout;
+}
+
+/************/
+/* BULKTAKE */
+/************/
+int bulkTake(struct controller * c, char * in, int len, int end, int * binary, int decimals, long * records, long * bad) {
+// Send the first value in the len bytes at in, counting it in records or bad.  Return the 
+// bytes used, or 0 if more are needed; with end set there are no more, and all are used.
+// The first bytes say whether the input is binary.
+	struct bulkrec r;
+	char * cp;
+	int num, n;
+	long long val;
+	
+	if (len == 0) return 0;
+	if (*binary < 0) {
+		if (len < 8 && !end && memcmp(in, BULKMAGIC, len) == 0) return 0;
+		*binary = len >= 8 && memcmp(in, BULKMAGIC, 8) == 0;
+		if (*binary) return 8;
+	}
+	if (*binary) {
+		if (len < sizeof(r)) {
+			if (!end) return 0;
+			(*bad)++;		// cut short
+			return len;
+		}
+		memcpy(&r, in, sizeof(r));
+		if (r.display < 1 || r.display > model->displays) (*bad)++;
+		else {
+			ricosend(c, r.display, r.value, r.decimals);
+			(*records)++;
+		}
+		return sizeof(r);
+	}
+	if ((cp = memchr(in, '\n', len))) n = cp - in + 1;
+	else if (end) n = len;
+	else return 0;
+	in[n - (cp != NULL)] = '\0';		// in[] has room for one more
+	for (cp = in; *cp == ' ' || *cp == '\t'; cp++);
+	if (*cp == '\0' || *cp == '\r' || *cp == '#') return n;		// blank or a comment
+	if (scanDisp(cp, &num, &val, &decimals) < 2 || num < 1 || num > model->displays) {
+		DEBUG fprintf(stderr, "Bulk: can't use '%s' ", cp);
+		(*bad)++;
+		return n;
+	}
+	ricosend(c, num, val, decimals);
+	(*records)++;
+	return n;
+}
+
+/**********/
+/* AGGSET */
+/**********/
+void aggSet(struct controller * c, int num, int mode, int seconds, int decimals) {
+// Start aggregating a display's samples afresh, or stop with AGG_NONE
+	struct agg * a = &c->agg[num];
+	
+	if (seconds < 1) seconds = 1;
+	bzero(a, sizeof(*a));
+	a->mode = mode;
+	a->width = seconds * 1000L / AGGBUCKETS;
+	if (a->width < 1) a->width = 1;
+	a->decimals = decimals;
+	a->start = msNow();
+	if (!c->aggdue) c->aggdue = a->start + aggperiod;
+}
+
+/*************/
+/* AGGSAMPLE */
+/*************/
+void aggSample(struct controller * c, int num, long long val) {
+// Add a sample to the display's current bucket
+	struct agg * a = &c->agg[num];
+	long long now = msNow();
+	
+	if (a->mode == AGG_NONE) aggSet(c, num, AGG_MEAN, AGGWINDOW, 3);
+	if (a->mode == AGG_KW && a->n && val < a->last) 
+		aggSet(c, num, AGG_KW, a->width * AGGBUCKETS / 1000, a->decimals);	// meter reset: start again
+	aggAdvance(a, now);
+	if (a->b[a->cur].n == 0) {
+		a->b[a->cur].min = a->b[a->cur].max = a->b[a->cur].first = val;
+		a->b[a->cur].firstat = now;
+	}
+	if (val < a->b[a->cur].min) a->b[a->cur].min = val;
+	if (val > a->b[a->cur].max) a->b[a->cur].max = val;
+	a->b[a->cur].n++;
+	a->b[a->cur].sum += val;
+	a->n++;
+	a->sum += val;
+	a->last = val;
+	a->lastat = now;
+}
+
+/**************/
+/* AGGADVANCE */
+/**************/
+void aggAdvance(struct agg * a, long long now) {
+// Move the current bucket on to now, emptying those it passes.  After a long silence
+// the window is simply cleared.
+	if (now - a->start >= (long) a->width * AGGBUCKETS) {
+		bzero(a->b, sizeof(a->b));
+		a->n = 0;
+		a->sum = 0;
+		a->start = now;
+		return;
+	}
+	while (now - a->start >= a->width) {
+		a->start += a->width;
+		a->cur = (a->cur + 1) % AGGBUCKETS;
+		a->n -= a->b[a->cur].n;
+		a->sum -= a->b[a->cur].sum;
+		a->b[a->cur].n = 0;
+		a->b[a->cur].sum = 0;
+	}
+}
+
+/************/
+/* AGGTIMER */
+/************/
+int aggTimer(struct controller * c) {
+// Send every aggregated display its value if it is time to.  A display with nothing in its
+// window is left showing what it had.  Return ms until the next time, or -1 if there are none.
+	struct agg * a;
+	long long now = msNow();
+	long long val;
+	int d, i, found;
+	
+	if (!c->aggdue) return -1;
+	if (now < c->aggdue) return c->aggdue - now;
+	c->aggdue += aggperiod;
+	if (c->aggdue <= now) c->aggdue = now + aggperiod;		// don't try to catch up
+	for (d = 1; d <= NUMDISPLAYS; d++) {
+		a = &c->agg[d];
+		if (a->mode == AGG_NONE) continue;
+		aggAdvance(a, now);
+		if (a->n == 0) continue;
+		val = a->sum / a->n;
+		i = a->cur;
+		found = 0;
+		if (a->mode != AGG_MEAN) 
+			do {		// oldest bucket first, so for kw the first one with samples is the earliest
+				i = (i + 1) % AGGBUCKETS;
+				if (a->b[i].n == 0) continue;
+				if (a->mode == AGG_KW) break;
+				if (a->mode == AGG_MIN && (!found || a->b[i].min < val)) val = a->b[i].min;
+				if (a->mode == AGG_MAX && (!found || a->b[i].max > val)) val = a->b[i].max;
+				found = 1;
+			} while (i != a->cur);
+		if (a->mode == AGG_KW) {		// kWh per hour
+			if (a->lastat == a->b[i].firstat) continue;		// needs two samples apart in time
+			val = (a->last - a->b[i].first) * 3600000LL / (a->lastat - a->b[i].firstat);
+		}
+		ricosend(c, d, val, a->decimals);
+	}
+	return c->aggdue - now;
+}
+
+#endif
+
+/**************/
+/* PARSEFIXED */
+/**************/
+int parseFixed(const char * s, long long * val, char ** end) {
+// Convert a decimal number such as -123.4567 or 1.5e3 to millionths, rounding 
+// anything finer to the nearest.  Return 1 if ok or 0 if there were no digits, 
+// so it can stand in for sscanf "%f".  If end is given it is set past the number.
+// Anything up to FIXMAX is exact to the millionth; a value beyond it is taken as FIXMAX.
+// Millionths have no negative zero, so -0 and -0.0, or anything that rounds to them,
+// come out as 0 and are shown unsigned where "%9.1f" of the float gave "-0.0".
+	long long v = 0;
+	int neg = 0, digits = 0, places = -1, exp = 0, round = 0, over = 0, dropped = 0, lost = 0, n;
+	const char * cp;
+	
+	while (*s == ' ' || *s == '\t') s++;
+	if (*s == '-' || *s == '+') neg = *s++ == '-';
+	for (;; s++) {
+		if (*s == '.' && places < 0) { places = 0; continue; }
+		if (*s < '0' || *s > '9') break;
+		digits++;
+		if (!dropped && places < 6 && v <= (FIXMAX - 9) / 10) {
+			v = v * 10 + *s - '0';
+			if (places >= 0) places++;
+		} else {		// no room for it: the first one left out decides the rounding
+			if (!dropped++) round = *s >= '5';
+			if (places < 0) lost++;		// but a whole number's digits still count
+		}
+	}
+	if (!digits) return 0;
+	if (places < 0) places = 0;
+	places -= lost;
+	if (*s == 'e' || *s == 'E') {		// exponent, if it is one
+		cp = s + 1;
+		n = *cp == '-' ? -1 : 1;
+		if (*cp == '-' || *cp == '+') cp++;
+		if (*cp >= '0' && *cp <= '9') {
+			while (*cp >= '0' && *cp <= '9') if ((exp = exp * 10 + *cp++ - '0') > 99) exp = 99;	// past any long long
+			exp *= n;
+			s = cp;
+		}
+	}
+	for (places -= exp; places > 6; places--) {
+		round = v % 10 >= 5;
+		v /= 10;
+	}
+	if (v < FIXMAX) v += round;
+	for (; places < 6 && !over; places++)
+		if (v > FIXMAX / 10) over = 1;
+		else v *= 10;
+	if (over) v = FIXMAX;
+	*val = neg ? -v : v;
+	if (end) *end = (char *) s;
+	return 1;
+}
+
+/**********/
+/* FIXMUL */
+/**********/
+long long fixMul(long long a, long long b) {
+// Multiply two values in millionths, rounding the result to the nearest millionth.
+// Split a so that the intermediate products stay within 64 bits.
+	long long hi = a / FIXONE, lo = a % FIXONE;
+	long long r = lo * b;
+	return hi * b + (r + (r < 0 ? -FIXONE / 2 : FIXONE / 2)) / FIXONE;
+}
+
+/**************/
+/* GETVERSION */
+/**************/
+char *getversion(void) {
+// return pointer to version part of REVISION macro
+	static char version[10] = "";	// Room for xxxx.yyyy
+	if (!strlen(version)) {
+		strcpy(version, REVISION+11);
+		version[strlen(version)-2] = '\0';
+	}
+return version;
+}
+
+/*************/
+/* RICOFRAME */
+/*************/
+int ricoframe(union frame * f, int bus, int display, long long value, int decimals) {
+	// Build the frame to send the value to the display number, with the model's encoder.
+	// If decimals is less than 0, automatically determine it 
+	// Return 1 (and log it) if the display is out of range
+	int i;
+	DEBUG fprintf(stderr,"Ricoframe %d %s%lld.%06lld %d digits. ", display, value < 0 ? "-" : "", 
+		(value < 0 ? -value : value) / FIXONE, (value < 0 ? -value : value) % FIXONE, decimals);
+	if (display < 1 || display > model->displays) {
+		sprintf(buffer, "WARN " PROGNAME " Display is not in range 1 to %d: %d", model->displays, display);
+		logmsg(WARN, buffer);
+		return 1;
+	}
+	model->encode(f, bus, display, value, decimals);
+	
+	DEBUG2 {
+		fprintf(stderr, "Sum = %x ", f->raw[framelen - 1]);
+		fprintf(stderr, "Sending ");
+		for (i = 0; i < framelen; i++) fprintf(stderr, "%02x ", f->raw[i]);
+		fprintf(stderr, " '");
+		for (i = 0; i < model->width; i++) fprintf(stderr, "%c", f->s.value[i]);
+		fprintf(stderr, "'\n");
+	}
+	return 0;
+}
+
+/***************/
+/* FRAMEENCODE */
+/***************/
+static inline void frameEncode(union frame * f, int width, int bus, int display, long long value, int decimals,
+	long long auto2, long long auto1) {
+	// Build a frame for a model with value fields width characters wide.  Each encode function
+	// calls this with its model's constants, so they are folded into a copy of its own.
+	// The value is rendered as printf "%*.Nf" would, straight into the frame: right aligned,
+	// ties rounded to even, and only the first width characters if it is any wider.
+	// Only turning the value into digits depends on how long it is.
+	static const long long scale[7] = {1000000, 100000, 10000, 1000, 100, 10, 1};
+	int i, sum, neg = value < 0;
+	unsigned long long v, div, rem;
+	char digits[VALUEMAX + 24], * cp = digits + sizeof(digits);
+	
+	memset(f->raw, 0, FRAMELEN);
+	memset(digits, ' ', sizeof(digits));	// spaces to the left of it, so it can be copied whole
+	f->s.N = 'N';	
+	f->s.bus = bus;
+	f->s.displ = display;
+	if (decimals < 0) decimals = 2 - (value > auto2) - (value > auto1);
+	else if (decimals > 3) decimals = 6;	// "%9f"
+	
+	v = neg ? -(unsigned long long) value : value;
+	div = scale[decimals];
+	rem = v % div;
+	v /= div;
+	v += rem * 2 > div || (rem * 2 == div && (v & 1));
+	for (i = 0; i < decimals; i++) {
+		*--cp = '0' + v % 10;
+		v /= 10;
+	}
+	if (decimals) *--cp = '.';
+	do {
+		*--cp = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (neg) *--cp = '-';
+	i = digits + sizeof(digits) - cp;		// length
+	memcpy(f->s.value, i > width ? cp : digits + sizeof(digits) - width, width);
+	sum = 0;
+	for (i = 0; i < width + 3; i++) sum += f->raw[i];
+	f->raw[width + 3] = sum;
+}
+
+// One encoder for each model
+#define MODEL(name, width, displays, auto2, auto1) \
+void encode##name(union frame * f, int bus, int display, long long value, int decimals) { \
+	frameEncode(f, width, bus, display, value, decimals, auto2, auto1); \
+}
+RICOMODELS
+#undef MODEL
+
+/*************/
+/* MODELFIND */
+/*************/
+struct model * modelFind(const char * name) {
+	int i;
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+		if (strcasecmp(models[i].name, name) == 0) return &models[i];
+	return NULL;
+}
+
+/************/
+/* RICOSEND */
+/************/
+void ricosend (struct controller * c, int display, long long value, int decimals) {
+	// Queue the value for the display number, replacing any value not yet sent.
+	// The main loop calls pump() to put it on the wire.  A frame the same as the one 
+	// the display is showing, or is about to, is not sent again.
+	union frame data;
+#ifndef SMALL
+	struct update u;
+#endif
+	
+	DEBUG fprintf(stderr,"Ricosend bus %d ", c->bus);
+	if (ricoframe(&data, c->bus, display, value, decimals)) return;
+#ifndef SMALL
+	if (threaded && !linethread) {
+		u.kind = UP_FRAME;
+		u.ctl = c - controllers;
+		u.n = display;
+		u.rcvd = msNow();
+		u.f = data;
+		post(&u);
+	} else
+#endif
+		ricoqueue(c, display, &data, msNow());
+}
+
+/*************/
+/* RICOQUEUE */
+/*************/
+void ricoqueue(struct controller * c, int display, union frame * f, long long rcvd) {
+	// Store a frame for pump() to send, unless it would change nothing
+	union frame data = *f;
+	
+	if (c->slot[display].showing && memcmp(data.raw, c->slot[display].shown.raw, FRAMELEN) == 0) {
+		DEBUG fprintf(stderr, "already shown ");
+		c->slot[display].queued = 0;		// whatever was waiting has been put back
+		c->slot[display].f = data;
+		c->count[display].suppressed++;
+		c->line->count.suppressed++;
+		return;
+	}
+	if (c->slot[display].queued && memcmp(data.raw, c->slot[display].f.raw, FRAMELEN) == 0) {
+		DEBUG fprintf(stderr, "already queued ");
+		c->count[display].suppressed++;
+		c->line->count.suppressed++;
+		return;
+	}
+	DEBUG if (c->slot[display].queued) fprintf(stderr, "replaces unsent value ");
+	c->slot[display].f = data;
+	c->slot[display].o.rcvd = rcvd;
+	c->slot[display].o.tries = 0;
+	if (!c->slot[display].queued) c->slot[display].queued = c->slot[display].o.rcvd;
+}
+
+/*********/
+/* BURST */
+/*********/
+void burst(struct controller * c, int n) {
+	// The last n frames queued for the controller came in one message: send them together
+#ifndef SMALL
+	struct update u;
+#endif
+	
+#ifndef SMALL
+	if (threaded && !linethread) {
+		u.kind = UP_BURST;
+		u.ctl = c - controllers;
+		u.n = n;
+		post(&u);
+	} else
+#endif
+		c->line->burst += n;
+}
+
+/********/
+/* PUMP */
+/********/
+int pump(struct line * l) {
+	// Once the line has finished sending, write the most important queued frames
+	// of the controllers on it, as many as fit in TXWINDOW.  kW goes before everything 
+	// else and CO2 last, but a frame that has waited STARVED ms goes first.  Controllers
+	// sharing the line take turns to go first.  Displays held off by their breaker wait.
+	// Return the ms until there will be room to send the next frame or -1 if nothing is queued.
+	static const int order[NUMDISPLAYS] = {3, 2, 1, 4, 5, 6, 7, 8};
+	union frame f[MAXBATCH];
+	struct origin o[MAXBATCH];
+	struct controller * c, * cs[MAXCONTROLLERS];
+	int i, j, d, n, nc = 0, max, queued = 0, held = -1;
+	long long now = msNow();
+	
+	for (i = 0; i < numcontrollers; i++) {		// round robin, starting from l->next
+		c = &controllers[(l->next + i) % numcontrollers];
+		if (c->line != l) continue;
+		cs[nc++] = c;
+		for (d = 1; d <= NUMDISPLAYS; d++) {
+			if (!c->slot[d].queued) continue;
+			if (c->slot[d].hold <= now) queued = 1;
+			else if (held < 0 || c->slot[d].hold - now < held) held = c->slot[d].hold - now;
+		}
+	}
+	if (!queued) return held;		// nothing to send yet
+	if (l->connecting || l->fd < 0) return -1;	// lineTimer will say when
+	if (l->busy > now) return l->busy - now;
+	
+	max = TXWINDOW / l->frametime;
+	if (max < l->burst) max = l->burst;		// a batch from the MCP goes out in one
+	if (max < 1) max = 1;
+	if (max > MAXBATCH) max = MAXBATCH;
+	l->burst = 0;
+	n = 0;
+	for (j = 0; j < nc; j++)
+		for (d = 1, c = cs[j]; d <= NUMDISPLAYS && n < max; d++)
+			if (c->slot[d].queued && c->slot[d].hold <= now && now - c->slot[d].queued >= STARVED) {
+				o[n] = c->slot[d].o;
+				f[n++] = c->slot[d].f;
+				c->slot[d].queued = 0;
+			}
+	for (i = 0; i < NUMDISPLAYS && n < max; i++)
+		for (j = 0, d = order[i]; j < nc && n < max; j++)
+			if ((c = cs[j])->slot[d].queued && c->slot[d].hold <= now) {
+				o[n] = c->slot[d].o;
+				f[n++] = c->slot[d].f;
+				c->slot[d].queued = 0;
+			}
+	l->next = (cs[0] - controllers + 1) % numcontrollers;
+	ricowrite(l, f, o, n);
+	l->busy = now + n * l->frametime;
+	for (j = 0; j < nc; j++)
+		for (d = 1; d <= NUMDISPLAYS; d++) 
+			if (cs[j]->slot[d].queued && cs[j]->slot[d].hold <= now) return n * l->frametime;
+	return held;
+}
+
+/*************/
+/* FRAMETIME */
+/*************/
+int frameTime(int baud) {
+	// Milliseconds to transmit one frame of 10 bit characters, rounded up
+	int bps;
+	switch (baud) {
+		case B1200: bps = 1200; break;
+		case B2400: bps = 2400; break;
+		case B4800: bps = 4800; break;
+		case B19200: bps = 19200; break;
+		case B38400: bps = 38400; break;
+		default: bps = 9600; break;
+	}
+	return (framelen * 10 * 1000 + bps - 1) / bps;
+}
+
+/*************/
+/* RICOWRITE */
+/*************/
+void ricowrite(struct line * l, union frame * f, struct origin * o, int n) {
+	// Put n frames on the wire back to back and queue them to be matched with replies
+	// by readReply, unless the line never replies.  If the queue is full the oldest is forgotten.
+	int i, sent;
+	struct controller * c;
+	long long now = msNow();
+	
+	sent = sendFrames(l, f, n);
+	for (i = sent; i < n; i++)		// not sent: keep for when the line is back unless superseded
+		if ((c = busController(l, f[i].s.bus)) && !c->slot[f[i].s.displ].queued) {
+			c->slot[f[i].s.displ].f = f[i];
+			c->slot[f[i].s.displ].queued = now;
+			c->slot[f[i].s.displ].o = o[i];
+		}
+	for (i = 0; i < sent; i++) {
+		l->count.sent++;
+		if ((c = busController(l, f[i].s.bus))) {
+			c->count[f[i].s.displ].sent++;
+			c->slot[f[i].s.displ].shown = f[i];		// unless it fails
+			c->slot[f[i].s.displ].showing = 1;
+		}
+		if (l->noack) continue;
+		if (l->npending == MAXPENDING) {
+			DEBUG fprintf(stderr, "Pending queue full - forgetting display %d ", l->pending[l->head].f.s.displ);
+			l->head = (l->head + 1) % MAXPENDING;
+			l->npending--;
+		}
+		l->pending[(l->head + l->npending) % MAXPENDING].f = f[i];
+		l->pending[(l->head + l->npending) % MAXPENDING].sent = now + (i + 1) * l->frametime;
+		l->pending[(l->head + l->npending) % MAXPENDING].o = o[i];
+		l->npending++;
 	}
-	if (strncmp(buffer, "disp ", 5) == 0) {
-		int num, decimals;
-		decimals = 3;
-		n = sscanf(buffer+5, "%d %f %d", &num, &val, &decimals);
-		if (n != 2 && n!= 3) {
-			logmsg(WARN, "WARN " PROGNAME " failed to get display number and value");
-			return 1;
+}
+
+/*****************/
+/* BUSCONTROLLER */
+/*****************/
+struct controller * busController(struct line * l, int bus) {
+	// Return the controller a frame on this line and bus came from, or NULL
+	struct controller * c;
+	for (c = controllers; c < controllers + numcontrollers; c++)
+		if (c->line == l && c->bus == bus) return c;
+	return NULL;
+}
+
+/*************/
+/* READREPLY */
+/*************/
+void readReply(struct line * l) {
+	// The line is readable.  Each reply byte settles the oldest frame waiting: '<' is ok, 
+	// anything else a failure. Bytes with nothing waiting are ignored, but show that the
+	// line does reply after all.
+	int i, ret;
+	unsigned char reply[FRAMELEN];
+	
+	ret = read(l->fd, reply, FRAMELEN);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN)) return;
+	if (ret <= 0) {		// readable but nothing there: hangup or remote end closed
+		lineDown(l, ret ? errno : 0);		// lineTimer will reopen it
+		return;
+	}
+#ifndef SMALL
+	trace(TR_REPLY, l - lines, reply, ret);
+#endif
+	l->backoff = 0;		// it works: a later failure can be retried quickly
+	l->silent = 0;
+	if (l->noack) {
+		l->noack = 0;
+		sprintf(buffer, "INFO " PROGNAME " %d %s is replying: waiting for replies again", ctl->num, l->name);
+		logmsg(INFO, buffer);
+	}
+	DEBUG2 {
+		fprintf(stderr, "Read %d chars: ", ret);
+		for (i = 0; i < ret; i++) fprintf(stderr, "%c [%02x] ", reply[i], reply[i]);
+	}
+	for (i = 0; i < ret && l->npending; i++) {
+		if (reply[i] == RICOACK) {
+			DEBUG fprintf(stderr, "Display %d ok after %lld ms ", l->pending[l->head].f.s.displ, msNow() - l->pending[l->head].sent);
+			learnRtt(l, msNow() - l->pending[l->head].sent);
+		} else {
+			DEBUG fprintf(stderr, "Display %d failed (0x%02x) ", l->pending[l->head].f.s.displ, reply[i]);
 		}
-		if (num == 2 && watts)	// WATTS - frig for Ecotech since MCP doesn't send kw
-			ricosend(fd, num, val * 1000.0, 3);
-		else
-			ricosend(fd, num, val, decimals);	// Send value to specified display, with 3 decimal places
-		return 1;
+		settle(l, reply[i] == RICOACK ? RICOACK : 0);
 	}
-	strcpy(buffer2, "INFO " PROGNAME " Unknown message from server: ");
-	strcat(buffer2, buffer);
-	logmsg(INFO, buffer2);	// Risk of loop: sending unknown message straight back to server
+}
+
+/**************/
+/* ACKTIMEOUT */
+/**************/
+int ackTimeout(struct line * l) {
+	// Fail frames that have waited the line's ack timeout without a reply.  Return the number 
+	// of ms until the next one is due to expire, or -1 if none are waiting.
+	// A line that has never replied, and has let NOACKLIMIT frames in a row time out, is
+	// taken to be one that can't (RS422) and is no longer waited for.
+	long long now = msNow();
+	while (l->npending && now - l->pending[l->head].sent >= l->ato) {
+		DEBUG fprintf(stderr, "No response from display %d\n", l->pending[l->head].f.s.displ);
+		settle(l, -1);
+		if (++l->silent >= NOACKLIMIT && !l->count.acked && !l->count.naked) {
+			l->noack = 1;
+			l->npending = 0;
+			sprintf(buffer, "INFO " PROGNAME " %d No replies on %s: not waiting for them", l->owner->num, l->name);
+			logmsg(INFO, buffer);
+		}
+	}
+	if (l->npending == 0) return -1;
+	return l->pending[l->head].sent + l->ato - now;
+}
+
+/**************/
+/* SENDFRAMES */
+/**************/
+int sendFrames(struct line * l, union frame * f, int n) {
+	// Send n frames in as few writes as possible.  Return number of frames sent.
+	// A short write is completed from where it stopped; after a failure the port is 
+	// reopened and the interrupted frame is sent again from its start.  If that keeps
+	// failing the line is left closed for lineTimer to retry later.
+	int retries = SERIALNUMRETRIES;
+	int written, i, sent = 0, offset = 0;	// whole frames sent, and bytes of the next one
+	int cork = 1;
+	struct iovec iov[MAXBATCH];
+#ifndef SMALL
+	unsigned char wire[MAXBATCH * FRAMELEN];	// what was sent, for the trace
+#endif
 	
-	return 1;	
-};
+	if (n > MAXBATCH) n = MAXBATCH;
+	if (l->fd < 0 && reopenLine(l)) return 0;
+#ifdef DEBUGCOMMS
+	for (i = 0; i < n * framelen; i++) fprintf(stderr, "Comm 0x%02x(%d) ", f[i / framelen].raw[i % framelen], f[i / framelen].raw[i % framelen]);
+	return n;
+#endif
+	DEBUG2 for (i = 0; i < n * framelen; i++) fprintf(stderr, "%02x ", f[i / framelen].raw[i % framelen]);
+	if (l->netport && n > 1) setsockopt(l->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	
+	while (sent < n) {
+		for (i = sent; i < n; i++) {
+			iov[i - sent].iov_base = f[i].raw;
+			iov[i - sent].iov_len = framelen;
+		}
+		iov[0].iov_base = f[sent].raw + offset;
+		iov[0].iov_len = framelen - offset;
+		written = writev(l->fd, iov, n - sent);
+		if (written > 0) {
+			l->bytes += written;
+			offset += written;
+			sent += offset / framelen;
+			offset %= framelen;
+			continue;
+		}
+		if (written < 0 && errno == EINTR) continue;
+		
+		fprintf(stderr, "Serial wrote %d bytes errno = %d", written, errno);
+		sprintf(buffer, "INFO " PROGNAME " SendFrames: Failed to write data: %s", strerror(errno));
+		logmsg(INFO, buffer);
+		if (--retries == 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d SendFrames: too many retries on %s", ctl->num, l->name);
+			logmsg(WARN, buffer);
+			lineDown(l, errno);
+			break;
+		}
+		if (reopenLine(l)) break;
+		offset = 0;		// the reopened port has lost the partial frame
+	}
+	if (l->netport && n > 1 && l->fd >= 0) {		// uncorking sends the batch
+		cork = 0;
+		setsockopt(l->fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	}
+#ifndef SMALL
+	if (sent && tracefd >= 0) {		// only framelen bytes of each frame went out
+		for (i = 0; i < sent; i++) memcpy(wire + i * framelen, f[i].raw, framelen);
+		trace(TR_FRAMES, l - lines, wire, sent * framelen);
+	}
+#endif
+	return sent;
+}
 
 /**************/
-/* GETVERSION */
+/* REOPENLINE */
 /**************/
-char *getversion(void) {
-// return pointer to version part of REVISION macro
-	static char version[10] = "";	// Room for xxxx.yyyy
-	if (!strlen(version)) {
-		strcpy(version, REVISION+11);
-		version[strlen(version)-2] = '\0';
+int reopenLine(struct line * l) {
+	// Close and reopen a line after an error.  Return 1 for a logged failure,
+	// leaving fd as -1 for lineTimer to try again later.  A netport is left for
+	// lineTimer to reconnect in the background.
+	l->reopens++;
+	if (l->netport) {
+		lineDown(l, errno);
+		return 1;
 	}
-return version;
+	if (l->fd >= 0) close(l->fd);
+	l->fd = openSerial(l->name, l->baud, 0, CS8, 1);
+	if (l->fd < 0) {
+		lineDown(l, errno);
+		return 1;
+	}
+	watch(l->fd, EV_LINE, l - lines);
+	if (l->warned) {
+		sprintf(buffer, "INFO " PROGNAME " %d Reopened %s", ctl->num, l->name);
+		logmsg(INFO, buffer);
+		l->warned = 0;
+	}
+	return 0;
+}
+
+/**********/
+/* SETTLE */
+/**********/
+void settle(struct line * l, int what) {
+	// Deal with the oldest pending frame being answered: RICOACK, -1 for no reply or anything
+	// else for a NAK.  Count it, and send a failed frame again up to RETRANSMIT times unless its 
+	// display has had something newer since.  A display that keeps failing has its breaker opened: its 
+	// frames are held back and only one is tried every BREAKERTIME ms until one succeeds.
+	struct controller * c;
+	struct counts * k[2];
+	long long ms, now = msNow();
+	int j, b, d;
+	
+	d = l->pending[l->head].f.s.displ;
+	c = busController(l, l->pending[l->head].f.s.bus);
+	k[0] = &l->count;
+	k[1] = c ? &c->count[d] : NULL;
+	ms = now - l->pending[l->head].o.rcvd;
+	for (b = 0; b < LATBUCKETS - 1 && ms >= (1L << b); b++);
+	for (j = 0; j < 2 && k[j]; j++) {
+		if (what == RICOACK) {
+			k[j]->acked++;
+			k[j]->latency[b]++;
+		} 
+		else if (what < 0) k[j]->timedout++;
+		else k[j]->naked++;
+	}
+	if (c && what == RICOACK) {
+		if (c->slot[d].fails >= BREAKERFAILS) {
+			ctl = c;
+			sprintf(buffer, "INFO " PROGNAME " %d Display %d is answering again", c->num, d);
+			logmsg(INFO, buffer);
+		}
+		c->slot[d].fails = 0;
+		c->slot[d].hold = 0;
+	}
+	else if (c) {
+		if (memcmp(c->slot[d].shown.raw, l->pending[l->head].f.raw, FRAMELEN) == 0) c->slot[d].showing = 0;
+		if (++c->slot[d].fails == BREAKERFAILS) {
+			ctl = c;
+			sprintf(buffer, "WARN " PROGNAME " %d Display %d has failed %d times: trying it every %d s", 
+				c->num, d, BREAKERFAILS, BREAKERTIME / 1000);
+			logmsg(WARN, buffer);
+		}
+		if (c->slot[d].fails >= BREAKERFAILS) c->slot[d].hold = now + BREAKERTIME;	// tried again then, however often
+		if (!c->slot[d].queued && (c->slot[d].fails >= BREAKERFAILS || l->pending[l->head].o.tries < RETRANSMIT)
+				&& memcmp(c->slot[d].f.raw, l->pending[l->head].f.raw, FRAMELEN) == 0) {	// still the latest
+			c->slot[d].f = l->pending[l->head].f;
+			c->slot[d].o = l->pending[l->head].o;
+			c->slot[d].o.tries++;
+			c->slot[d].queued = now;
+			l->count.retries++;
+			c->count[d].retries++;
+		}
+	}
+	l->head = (l->head + 1) % MAXPENDING;
+	l->npending--;
 }
 
 /************/
-/* RICOSEND */
+/* LEARNRTT */
 /************/
-void ricosend (int fd, int display, float value, int decimals) {
-	// Send the value to the display number
-	// If decimals is less than 0, automatically determine it 
-	union {
-		unsigned char raw[13];
-		struct {
-			unsigned char N;
-			unsigned char bus;
-			unsigned char displ;
-			char value[9];
-			unsigned char checksum;
-		} s;
-	} data;
-	
-	int i, sum;
-	data.s.N = 'N';	
-	data.s.bus = bus;	// it's a global. Sorry.
-	char * format;
-	DEBUG fprintf(stderr,"Ricosend FD = %d %d %f %d digits. ", fd, display, value, decimals);
-	if (display < 1 || display > 8) {
-		sprintf(buffer, "WARN " PROGNAME " Display is not in range 1 to 8: %d", display);
-		logmsg(WARN, buffer);
-		return;
+void learnRtt(struct line * l, long rtt) {
+	// Update the line's smoothed round trip time and from it the ack timeout, which is
+	// the round trip time plus four deviations, as TCP does (RFC 6298)
+	int m = rtt < 0 ? 0 : rtt;
+	
+	if (l->count.acked == 0) {		// first measurement
+		l->srtt = m << 3;
+		l->rttvar = m << 1;
+	} else {
+		m -= l->srtt >> 3;
+		l->srtt += m;
+		if (m < 0) m = -m;
+		m -= l->rttvar >> 2;
+		l->rttvar += m;
 	}
-	data.s.displ = display;
-	if (decimals < 0) 
-		if (value > 99999.99)
-			decimals = 0;
-		else if (value > 9999.99)
-			decimals = 1;
-		else
-			decimals = 2;
+	l->ato = (l->srtt >> 3) + l->rttvar;
+	if (l->ato < ACKMIN) l->ato = ACKMIN;
+	if (l->ato > ACKMAX) l->ato = ACKMAX;
+}
+
+/*********/
+/* STATS */
+/*********/
+void stats(struct controller * c, int withline) {
+	// Report the counters for a controller's displays, and for its line if asked, as INFO events.
+	// The latency histogram goes in an event of its own so neither is cut short by logmsg.
+	// Displays that have never been given anything are left out.
+	char msg[300];
+	int d, n;
+	struct line * l = c->line;
+#ifndef SMALL
+	struct update u;
 	
-	switch(decimals) {
-		case 0: format = "%9.0f"; break;
-		case 1: format = "%9.1f"; break;
-		case 2: format = "%9.2f"; break;
-		case 3: format = "%9.3f"; break;
-		default: format = "%9f"; break;
+	if (threaded && !linethread) {		// the counters are the line thread's
+		u.kind = UP_STATS;
+		u.ctl = c - controllers;
+		u.n = withline;
+		post(&u);
+		return;
 	}
-	sprintf(data.s.value, format, value);
-	sum = 0;
-	for (i = 0; i < 12; i++) sum += data.raw[i];
-	data.s.checksum = sum;
+#endif
+	ctl = c;
+	if (withline) {
+		sprintf(msg, "INFO " PROGNAME " %d Stats %.40s: bytes %lld reopens %ld ack timeout %d%s", c->num, l->name, 
+			l->bytes, l->reopens, l->ato, l->noack ? " (not used)" : "");
+		logmsg(INFO, msg);
+		n = sprintf(msg, "INFO " PROGNAME " %d Stats %.40s: ", c->num, l->name);
+		countsText(msg + n, &l->count);
+		logmsg(INFO, msg);
+		latencyText(msg + n, &l->count);
+		logmsg(INFO, msg);
+	}
+	for (d = 1; d <= NUMDISPLAYS; d++) {
+		if (!c->count[d].sent && !c->count[d].suppressed) continue;
+		n = sprintf(msg, "INFO " PROGNAME " %d Stats display %d: ", c->num, d);
+		countsText(msg + n, &c->count[d]);
+		logmsg(INFO, msg);
+		latencyText(msg + n, &c->count[d]);
+		logmsg(INFO, msg);
+	}
+}
+
+/**************/
+/* COUNTSTEXT */
+/**************/
+int countsText(char * s, struct counts * k) {
+	// Format the counters other than latency
+	return sprintf(s, "sent %ld ack %ld nak %ld timeout %ld retry %ld refresh %ld suppressed %ld (%ld%%)", 
+		k->sent, k->acked, k->naked, k->timedout, k->retries, k->refreshed, k->suppressed,
+		k->suppressed ? k->suppressed * 100 / (k->suppressed + k->sent) : 0);
+}
+
+/***************/
+/* LATENCYTEXT */
+/***************/
+int latencyText(char * s, struct counts * k) {
+	// Format the latency buckets separated by /, the empty ones at the end left off
+	int b, last, n;
+	n = sprintf(s, "latency ");
+	for (last = LATBUCKETS - 1; last > 0 && !k->latency[last]; last--);
+	for (b = 0; b <= last; b++) n += sprintf(s + n, b ? "/%ld" : "%ld", k->latency[b]);
+	return n;
+}
+
+#ifndef SMALL
+/***********/
+/* SHMOPEN */
+/***********/
+void shmOpen(void) {
+	// Create or reuse a shared memory display table for each controller, and the eventfd and
+	// socket that producers use to wake us.  Values already in a reused table are sent.
+	// Failure is only a warning: the MCP still works.
+	struct controller * c;
+	struct sockaddr_un addr;
+	struct stat st;
+	char name[64];
+	int fd;
 	
-	DEBUG2 {
-		fprintf(stderr, "Sum = %x ", sum);
-		fprintf(stderr, "Sending ");
-		for (i = 0; i < 13; i++) fprintf(stderr, "%02x ", data.raw[i]);
-		fprintf(stderr, " '");
-		for (i = 0; i < 9; i++) fprintf(stderr, "%c", data.s.value[i]);
-		fprintf(stderr, "'\n");
+	ctl = &controllers[0];
+	shmevfd = eventfd(0, EFD_NONBLOCK);
+	shmsock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	bzero(&addr, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	sprintf(addr.sun_path + 1, "rico%d", getpid());		// abstract: nothing to clean up
+	if (shmevfd < 0 || shmsock < 0 || bind(shmsock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(shmsock, 5) < 0) {
+		sprintf(buffer, "WARN " PROGNAME " %d Can't set up shared memory wakeup: %s", ctl->num, strerror(errno));
+		logmsg(WARN, buffer);
+		return;
+	}
+	watch(shmevfd, EV_SHM, 0);
+	watch(shmsock, EV_SHMSOCK, 0);
+	for (c = controllers; c < controllers + numcontrollers; c++) {
+		ctl = c;
+		sprintf(name, RICOSHMFILE, c->num);
+		// /dev/shm is shared by everyone: only reuse a plain file of our own, never follow a link
+		if ((fd = open(name, O_RDWR | O_CREAT | O_NOFOLLOW, 0660)) >= 0 && (fstat(fd, &st) < 0
+			|| !S_ISREG(st.st_mode) || st.st_uid != geteuid() || st.st_nlink != 1)) {
+			close(fd);
+			fd = -1;
+			errno = EPERM;
+		}
+		if (fd < 0 || fchmod(fd, 0660) < 0		// whatever the umask, producers in our group need to write it
+			|| ftruncate(fd, sizeof(struct ricoshm)) < 0
+			|| (c->shm = mmap(NULL, sizeof(struct ricoshm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			sprintf(buffer, "WARN " PROGNAME " %d Can't share %s: %s", c->num, name, strerror(errno));
+			logmsg(WARN, buffer);
+			c->shm = NULL;
+		} else {
+			c->shm->pid = getpid();
+			strcpy(c->shm->sock, addr.sun_path + 1);
+			c->shm->magic = RICOSHMMAGIC;
+			shmDrain(c);
+		}
+		if (fd >= 0) close(fd);
 	}
-	for (i = 0; i < 13; i++) sendSerial(fd, data.raw[i]);
+}
+
+/*************/
+/* SHMACCEPT */
+/*************/
+void shmAccept(void) {
+	// Give the eventfd to a producer that has connected, and hang up
+	int fd;
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	char byte = 0, control[CMSG_SPACE(sizeof(int))];
 	
-	int ret;
-	// The RS232 port will return ok '<' or fail within 1/10th second.  The RS422 doesn't.
-//	usleep(100000);  // 100mSec
-	fd_set readfd;
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 100000;
-	FD_ZERO(&readfd);
-	FD_SET(fd, &readfd);
-	DEBUG fprintf(stderr, "Before FD=%d fdset=%x ", fd, readfd);
-	if (select(fd + 1, &readfd, NULL, NULL, &timeout) == 0) {	// select timed out. Bad news 
-		DEBUG fprintf(stderr, "No response\n");
+	while ((fd = accept(shmsock, NULL, NULL)) >= 0) {
+		bzero(&msg, sizeof(msg));
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &shmevfd, sizeof(int));
+		sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(fd);
 	}
-	else {
-		DEBUG fprintf(stderr, "FD readable .. ");
-		ret=read(fd, data.raw, 13);
-		DEBUG2 {
-			fprintf(stderr, "Read %d chars: ", ret);
-			for (i = 0; i < ret; i++) fprintf(stderr, "%c [%02x] ", data.raw[i], data.raw[i]);
+}
+
+/************/
+/* SHMDRAIN */
+/************/
+void shmDrain(struct controller * c) {
+	// Send the value of every slot in the controller's table that has changed since we last
+	// looked.  A slot being written, or written again while we read it, is read again, but 
+	// not for ever in case its writer has died: it is left for the next wakeup.
+	struct ricoshmslot * s;
+	uint32_t seq;
+	int d, decimals, tries;
+	long long value;
+	
+	if (!c->shm) return;
+	ctl = c;
+	for (d = 1; d <= NUMDISPLAYS; d++) {
+		s = &c->shm->slot[d];
+		for (tries = 0; tries < 1000; tries++) {
+			if ((seq = s->seq) & 1) continue;		// a writer is in it
+			__sync_synchronize();
+			value = s->value;
+			decimals = s->decimals;
+			__sync_synchronize();
+			if (s->seq == seq) break;
 		}
+		if (tries == 1000 || seq == c->shmseq[d]) continue;
+		c->shmseq[d] = seq;
+		if (decimals < -1 || decimals > 8) continue;
+		ricosend(c, d, value, decimals);
 	}
-	DEBUG fprintf(stderr, "After FD=%d fdset=%x ", fd, readfd);
 }
 
 /**************/
-/* SENDSERIAL */
+/* LISTENOPEN */
 /**************/
-int sendSerial(int fd, unsigned char data) {
-	// Send a single byte.  Return 1 for a logged failure
-	int retries = SERIALNUMRETRIES;
-	int written;
-	int newfd;
-#ifdef DEBUGCOMMS
-	fprintf(DEBUGFP, "Comm 0x%02x(%d) ", data, data);
-	return 0;
-#endif
+void listenOpen(char * port, char * path) {
+	// Listen for clients on a TCP port, on the loopback address unless another is given, 
+	// and on a unix socket.  Failure is only a warning: the MCP still works.
+	struct sockaddr_in in;
+	struct sockaddr_un un;
+	struct stat st;
+	char * cp;
+	int i, one = 1;
 	
-	DEBUG2 fprintf(stderr, "%02x ", data);
-	while ((written = write(fd, &data, 1)) < 1) {
-        fprintf(stderr, "Serial wrote %d bytes errno = %d", written, errno);
-		sprintf(buffer, "INFO " PROGNAME " SendSerial: Failed to write data: %s", strerror(errno));
-		logmsg(INFO, buffer);
-		close(fd);
-		newfd = openSerial(serialName, BAUD, 0, CS8, 1);
-		if (newfd < 0) {
-			sprintf(buffer, "WARN " PROGNAME " SendSerial: Error reopening serial/port: %s ", strerror(errno));
-			logmsg(WARN, buffer);
+	ctl = &controllers[0];
+	for (i = 0; i < MAXCLIENTS; i++) clients[i].fd = -1;
+	if (port) {
+		bzero(&in, sizeof(in));
+		in.sin_family = AF_INET;
+		inet_aton(LISTENADDR, &in.sin_addr);
+		if ((cp = strchr(port, ':'))) {
+			*cp++ = '\0';
+			if (!inet_aton(port, &in.sin_addr)) in.sin_addr.s_addr = INADDR_NONE;	// bind will say
+			port = cp;
 		}
-		if (newfd != fd) {
-			sprintf(buffer, "WARN " PROGNAME " SendSerial: Problem reopening socket - was %d now %d", fd, newfd);
+		in.sin_port = htons(atoi(port));
+		if ((listenfd[0] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) >= 0)
+			setsockopt(listenfd[0], SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (listenfd[0] < 0 || bind(listenfd[0], (struct sockaddr *) &in, sizeof(in)) < 0 || listen(listenfd[0], MAXCLIENTS) < 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d Can't listen on %s:%s: %s", ctl->num, inet_ntoa(in.sin_addr), port, strerror(errno));
 			logmsg(WARN, buffer);
-			return 1;
+			if (listenfd[0] >= 0) close(listenfd[0]);
+			listenfd[0] = -1;
+		} else
+			watch(listenfd[0], EV_LISTEN, 0);
+	}
+	if (path) {
+		bzero(&un, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+		if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);	// left by an earlier run
+		if ((listenfd[1] = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0 || strlen(path) >= sizeof(un.sun_path)
+			|| bind(listenfd[1], (struct sockaddr *) &un, sizeof(un)) < 0 || listen(listenfd[1], MAXCLIENTS) < 0) {
+			sprintf(buffer, "WARN " PROGNAME " %d Can't listen on %s: %s", ctl->num, path, 
+				strlen(path) >= sizeof(un.sun_path) ? "name too long" : strerror(errno));
+			logmsg(WARN, buffer);
+			if (listenfd[1] >= 0) close(listenfd[1]);
+			listenfd[1] = -1;
+		} else {
+			listenpath = path;
+			watch(listenfd[1], EV_LISTEN, 1);
 		}
-		if (--retries == 0) {
-			sprintf(buffer, "WARN " PROGNAME " %d SendSerial: too many retries", controllernum);
+	}
+}
+
+/****************/
+/* CLIENTACCEPT */
+/****************/
+void clientAccept(int index) {
+	// Take every client waiting on a listening socket.  They start off sending to the first
+	// controller, with a full second's credit.
+	struct client * cl;
+	int fd;
+	
+	while ((fd = accept(listenfd[index], NULL, NULL)) >= 0) {
+		for (cl = clients; cl < clients + MAXCLIENTS && cl->fd >= 0; cl++);
+		if (cl == clients + MAXCLIENTS) {
+			ctl = &controllers[0];
+			sprintf(buffer, "WARN " PROGNAME " %d Refused a client: already %d", ctl->num, MAXCLIENTS);
 			logmsg(WARN, buffer);
-			return 1;
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		bzero(cl, sizeof(*cl));
+		cl->fd = fd;
+		cl->c = &controllers[0];
+		cl->credit = clientrate * 1000L;
+		cl->stamp = msNow();
+		watch(fd, EV_CLIENT, cl - clients);
+		DEBUG fprintf(stderr, "Client %d connected on FD%d ", (int) (cl - clients), fd);
+	}
+}
+
+/***************/
+/* CLIENTEVENT */
+/***************/
+void clientEvent(struct client * cl, long long factor) {
+	// Read from a client and act on whatever it has credit for
+	int n;
+	
+	if (cl->fd < 0 || cl->paused) return;
+	ctl = cl->c;
+	n = read(cl->fd, cl->rx + cl->rxlen, sizeof(cl->rx) - 1 - cl->rxlen);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+	if (n <= 0) {
+		clientClose(cl);
+		return;
+	}
+	cl->rxlen += n;
+	takeMessages(cl->c, cl, cl->rx, &cl->rxlen, &cl->skip, factor);
+}
+
+/****************/
+/* CLIENTCREDIT */
+/****************/
+int clientCredit(struct client * cl) {
+	// Charge a client for one message.  If it can't pay, stop reading from it until 
+	// clientTimer finds it can, and return 0.  A rate of 0 means no limit.
+	struct epoll_event ev;
+	long long now = msNow();
+	
+	if (!clientrate) return 1;
+	cl->credit += (now - cl->stamp) * clientrate;	// ms times per second is thousandths
+	cl->stamp = now;
+	if (cl->credit > clientrate * 1000L) cl->credit = clientrate * 1000L;
+	if (cl->credit >= 1000) {
+		cl->credit -= 1000;
+		return 1;
+	}
+	if (!cl->paused) {
+		ev.events = 0;
+		ev.data.u64 = 0;
+		ev.data.u32 = EV_CLIENT << 16 | (cl - clients);
+		epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+		cl->paused = 1;
+		DEBUG fprintf(stderr, "Client %d paused ", (int) (cl - clients));
+	}
+	return 0;
+}
+
+/*****************/
+/* CLIENTCOMMAND */
+/*****************/
+void clientCommand(struct client * cl, char * msg, int len, long long factor) {
+	// Act on a message from a client.  Only display values are taken, and "controller N" 
+	// to send them to another of our controllers.
+	struct controller * c;
+	int num;
+	
+	if (sscanf(msg, "controller %d", &num) == 1) {
+		for (c = controllers; c < controllers + numcontrollers; c++)
+			if (c->num == num) {
+				cl->c = ctl = c;
+				return;
+			}
+		sprintf(buffer, "WARN " PROGNAME " %d Client asked for unknown controller %d", cl->c->num, num);
+		logmsg(WARN, buffer);
+		return;
+	}
+	if ((len && msg[0] == BATCHMARK) || strncmp(msg, "disp ", 5) == 0 || strncmp(msg, "disps ", 6) == 0
+		|| strncmp(msg, "kw ", 3) == 0 || strncmp(msg, "kwh ", 4) == 0 || strncmp(msg, "w ", 2) == 0
+		|| strncmp(msg, "sample ", 7) == 0 || strncmp(msg, "agg ", 4) == 0) {
+		command(cl->c, msg, len, factor);
+		return;
+	}
+	sprintf(buffer, "INFO " PROGNAME " %d Ignored from client: %.40s", cl->c->num, msg);
+	logmsg(INFO, buffer);
+}
+
+/***************/
+/* CLIENTTIMER */
+/***************/
+int clientTimer(long long factor) {
+	// Act on the messages held back from paused clients that now have the credit, and read 
+	// from them again if that leaves them any.  Return ms until the next one will have
+	// credit, or -1 if none is paused.
+	struct client * cl;
+	struct epoll_event ev;
+	int wait = -1, n;
+	
+	for (cl = clients; cl < clients + MAXCLIENTS; cl++) {
+		if (cl->fd < 0 || !cl->paused) continue;
+		n = (1000 - cl->credit - (msNow() - cl->stamp) * clientrate + clientrate - 1) / clientrate;
+		if (n <= 0) {
+			ctl = cl->c;
+			cl->paused = 0;
+			takeMessages(cl->c, cl, cl->rx, &cl->rxlen, &cl->skip, factor);
+			if (!cl->paused) {
+				ev.events = EPOLLIN;
+				ev.data.u64 = 0;
+				ev.data.u32 = EV_CLIENT << 16 | (cl - clients);
+				epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+				continue;
+			}
+			n = (1000 - cl->credit + clientrate - 1) / clientrate;
+		}
+		if (wait < 0 || n < wait) wait = n;
+	}
+	return wait;
+}
+
+/***************/
+/* CLIENTCLOSE */
+/***************/
+void clientClose(struct client * cl) {
+	// The client has gone, or is being got rid of.  Anything it had not paid for is lost.
+	DEBUG fprintf(stderr, "Client %d closed ", (int) (cl - clients));
+	close(cl->fd);
+	cl->fd = -1;
+	cl->paused = 0;
+}
+
+/***********/
+/* RINGPUT */
+/***********/
+int ringPut(struct ring * r, const void * item) {
+	// Producer: add an item.  Return 0 if the ring is full.
+	unsigned head = r->head;
+	
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size) return 0;	// its slot is read before we reuse it
+	memcpy(r->data + (head & (r->size - 1)) * r->item, item, r->item);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);		// the item is in place before the consumer can see it
+	r->kick = 1;
+	return 1;
+}
+
+/***********/
+/* RINGGET */
+/***********/
+int ringGet(struct ring * r, void * item) {
+	// Consumer: take the oldest item.  Return 0 if there isn't one.
+	unsigned tail = r->tail;
+	
+	if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) return 0;	// the item is there once its head is
+	memcpy(item, r->data + (tail & (r->size - 1)) * r->item, r->item);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);		// and its slot free once we have read it
+	return 1;
+}
+
+/************/
+/* RINGKICK */
+/************/
+void ringKick(struct ring * r) {
+	// Producer: wake the consumer once for everything put since last time.  The consumer
+	// clears the eventfd before it empties the ring, so nothing put can be missed.
+	uint64_t one = 1;
+	
+	if (!r->kick) return;
+	r->kick = 0;
+	if (write(r->efd, &one, sizeof(one)) < 0) return;
+}
+
+/********/
+/* POST */
+/********/
+void post(struct update * u) {
+	// Pass an update to the line thread.  A frame for a display that already has one kept
+	// back replaces it, so frames for a display never overtake each other.  Other updates
+	// are dropped if there is no room: they only hurry or count things.
+	if (u->kind == UP_FRAME && held[u->ctl][u->n].rcvd) {
+		held[u->ctl][u->n] = *u;
+		return;
+	}
+	if (ringPut(&updates, u)) {
+		posted++;
+		return;
+	}
+	if (u->kind != UP_FRAME) return;
+	held[u->ctl][u->n] = *u;
+	nheld++;
+}
+
+/************/
+/* POSTHELD */
+/************/
+int postHeld(void) {
+	// Try again with the frames that the ring was full for.  Return ms until the next 
+	// try, or -1 if there are none left.
+	int i, d;
+	
+	for (i = 0; i < numcontrollers && nheld; i++)
+		for (d = 1; d <= NUMDISPLAYS; d++)
+			if (held[i][d].rcvd && ringPut(&updates, &held[i][d])) {
+				held[i][d].rcvd = 0;
+				nheld--;
+				posted++;
+			}
+	return nheld ? UPDATEPOLL : -1;
+}
+
+/**************/
+/* TAKEEVENTS */
+/**************/
+void takeEvents(void) {
+	// Log whatever the line thread has sent back, as it would have done itself
+	struct event e;
+	static long reported = 0;		// of lostevents
+	long lost;
+	
+	while (ringGet(&events, &e)) {
+		ctl = &controllers[e.ctl];
+		logmsg(e.severity, e.text);
+	}
+	if ((lost = __atomic_load_n(&lostevents, __ATOMIC_RELAXED)) != reported) {
+		ctl = &controllers[0];
+		sprintf(buffer, "WARN " PROGNAME " %d %ld events from the line thread were lost", ctl->num, lost - reported);
+		reported = lost;
+		logmsg(WARN, buffer);
+	}
+}
+
+/**************/
+/* STARTLINES */
+/**************/
+void startLines(void) {
+	// Start the line thread, with no signals: they are for the main thread.
+	sigset_t all, old;
+	
+	if ((updates.efd = eventfd(0, EFD_NONBLOCK)) < 0 || (events.efd = eventfd(0, EFD_NONBLOCK)) < 0)
+		logmsg(FATAL, "FATAL " PROGNAME " Creating eventfds for the line thread");
+	watch(events.efd, EV_QUEUE, 0);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	if (pthread_create(&linetid, NULL, lineThread, NULL))
+		logmsg(FATAL, "FATAL " PROGNAME " Starting the line thread");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**************/
+/* LINETHREAD */
+/**************/
+void * lineThread(void * arg) {
+	// The main loop's work on the lines, plus taking frames from the update ring
+	struct epoll_event ev[MAXEVENTS];
+	struct update u;
+	struct controller * c;
+	struct line * l;
+	uint64_t count;
+	int wait, n, i, done, busy;
+	long acted = 0;		// updates taken from the ring and acted on
+	
+	linethread = 1;
+	epfd = lineepfd;
+	watch(updates.efd, EV_QUEUE, 0);
+	while (1) {
+		done = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);	// but first take whatever was posted before it was set
+		while (ringGet(&updates, &u)) {
+			ctl = c = &controllers[u.ctl];
+			if (u.kind == UP_FRAME) ricoqueue(c, u.n, &u.f, u.rcvd);
+			else if (u.kind == UP_BURST) c->line->burst += u.n;
+			else stats(c, u.n);
+			acted++;
+		}
+		if (done) break;
+		wait = -1;
+		busy = 0;
+		for (l = lines; l < lines + numlines; l++) {
+			ctl = l->owner;
+			n = lineTimer(l);
+			if (n >= 0 && (wait < 0 || n < wait)) wait = n;
+			if (queued(l) || l->npending) busy = 1;
+		}
+		if (!busy) __atomic_store_n(&updatesidle, acted, __ATOMIC_RELEASE);	// for the replay to know it has drained
+		ringKick(&events);
+		n = epoll_wait(epfd, ev, MAXEVENTS, wait);
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.u32 >> 16 == EV_QUEUE) {
+				read(updates.efd, &count, sizeof(count));
+				continue;
+			}
+			l = &lines[ev[i].data.u32 & 0xffff];
+			ctl = l->owner;
+			lineEvent(l, ev[i].events);
 		}
-		DEBUG fprintf(stderr, "SendSerial retry pausing %d ... ", SERIALRETRYDELAY);
-		usleep(SERIALRETRYDELAY);
 	}
-	return 0;       // ok
+	ringKick(&events);
+	return NULL;
+}
+
+#endif
+
+/*************/
+/* STAMPTIME */
+/*************/
+void stampTime(time_t t, char * s) {
+	// Format t as ctime does, "Sun Sep 16 01:03:52 1973", but in UTC and from first
+	// principles: days to a civil date as in H. Hinnant's days_from_civil, run backwards.
+	static const char * days = "ThuFriSatSunMonTueWed", * months = "MarAprMayJunJulAugSepOctNovDecJanFeb";
+	long z = t / 86400, secs = t % 86400, era, doe, yoe, y, doy, mp;
+	
+	if (secs < 0) {
+		secs += 86400;
+		z--;
+	}
+	memcpy(s, days + (z % 7 + 7) % 7 * 3, 3);
+	z += 719468;		// from 1970-01-01 to 0000-03-01
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	if (mp >= 10) y++;		// January and February are in the next year
+	sprintf(s + 3, " %.3s %2ld %02ld:%02ld:%02ld %4ld\n", months + mp * 3, doy - (153 * mp + 2) / 5 + 1,
+		secs / 3600, secs / 60 % 60, secs % 60, y);
+}
+
+/*********/
+/* MSNOW */
+/*********/
+long long msNow(void) {
+	// Milliseconds from the monotonic clock, for timing replies
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;		// 64 bits even where long is 32: no wrap after 24 days
 }
 
 /***********/
@@ -723,12 +3726,18 @@ void catcher(int sig) {
 // or indeed cause of SIGCHLD
 	char buf[200];
 	switch(sig) {
+	case SIGUSR1:		// dumped by the main loop, where it is safe to
+		statsdue = 1;
+		break;
+	case SIGHUP:		// likewise
+		reloaddue = 1;
+		break;
 	case SIGPIPE:
-		sprintf(buf, "INFO " PROGNAME " %d Caught SIGPIPE - ignoring", controllernum);
+		sprintf(buf, "INFO " PROGNAME " %d Caught SIGPIPE - ignoring", ctl->num);
 		logmsg(INFO, buf);
 		break;
 	default:
-		sprintf(buf, "WARN " PROGNAME " %d Caught Signal %d", controllernum, sig);
+		sprintf(buf, "WARN " PROGNAME " %d Caught Signal %d", ctl->num, sig);
 		logmsg(WARN, buf);
 	}
 }
@@ -0,0 +1,318 @@
+/* RICO value formatting microbenchmark */
+
+/* Compares the fixed point parse and render path in rico.c against the floating point
+   one it replaced (sscanf "%f", scaling in float and sprintf "%9.Nf"), first checking
+   that both produce the same frames for a spread of values and then timing each.
+   The paths can only differ where the float was itself wrong (more significant digits
+   than it holds), on an exact decimal tie, which the float broke according to which
+   side of it the binary value fell and the fixed point path breaks to even, or for a
+   value that parses to zero with a minus sign, which only the float shows as -0.
+   Then it checks each display model's encoder: Rico9's must give exactly the frames the
+   single fixed point ricoframe did before there were models, and the others the same
+   text wherever the value fits their width.  That and the time each takes are reported.
+   Build with 'make bench' using the same compiler as rico so that the target's
+   floating point emulation is what gets measured.
+
+   Usage: ricobench [iterations]
+*/
+
+#define main ricomain
+#include "rico.c"
+#undef main
+
+#define NUMVALUES 4096
+
+/************/
+/* OLDFRAME */
+/************/
+int oldframe(union frame * f, int bus, int display, float value, int decimals) {
+	// The floating point ricoframe as it was, less the debug output
+	int i, sum;
+	char * format;
+	char value9[32];
+	f->s.N = 'N';	
+	f->s.bus = bus;
+	f->s.displ = display;
+	if (decimals < 0) {
+		if (value > 99999.99)
+			decimals = 0;
+		else if (value > 9999.99)
+			decimals = 1;
+		else
+			decimals = 2;
+	}
+	
+	switch(decimals) {
+		case 0: format = "%9.0f"; break;
+		case 1: format = "%9.1f"; break;
+		case 2: format = "%9.2f"; break;
+		case 3: format = "%9.3f"; break;
+		default: format = "%9f"; break;
+	}
+	snprintf(value9, sizeof(value9), format, value);
+	memcpy(f->s.value, value9, 9);
+	sum = 0;
+	for (i = 0; i < 12; i++) sum += f->raw[i];
+	f->raw[12] = sum;
+	return 0;
+}
+
+/************/
+/* REFFRAME */
+/************/
+int refframe(union frame * f, int bus, int display, long long value, int decimals) {
+	// The fixed point ricoframe from before there were display models, less the debug output
+	static const long long scale[7] = {1000000, 100000, 10000, 1000, 100, 10, 1};
+	int i, sum, neg = value < 0;
+	unsigned long long v, div, rem;
+	char digits[24], * cp = digits + sizeof(digits);
+	f->s.N = 'N';	
+	f->s.bus = bus;
+	f->s.displ = display;
+	if (decimals < 0) {
+		if (value > 99999990000LL)	// 99999.99
+			decimals = 0;
+		else if (value > 9999990000LL)	// 9999.99
+			decimals = 1;
+		else
+			decimals = 2;
+	}
+	else if (decimals > 3) decimals = 6;	// "%9f"
+	
+	v = neg ? -(unsigned long long) value : value;
+	div = scale[decimals];
+	rem = v % div;
+	v /= div;
+	if (rem * 2 > div || (rem * 2 == div && (v & 1))) v++;
+	for (i = 0; i < decimals; i++) {
+		*--cp = '0' + v % 10;
+		v /= 10;
+	}
+	if (decimals) *--cp = '.';
+	do {
+		*--cp = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	if (neg) *--cp = '-';
+	i = digits + sizeof(digits) - cp;		// length
+	if (i < 9) {
+		memset(f->s.value, ' ', 9 - i);
+		memcpy(f->s.value + 9 - i, cp, i);
+	} else
+		memcpy(f->s.value, cp, 9);
+	sum = 0;
+	for (i = 0; i < 12; i++) sum += f->raw[i];
+	f->raw[12] = sum;
+	return 0;
+}
+
+/***********/
+/* REFTEXT */
+/***********/
+char * refText(char * s, int width, long long value, int decimals) {
+	// The value field printf "%*.Nf" would fill, ties to even, worked out the slow way: right 
+	// aligned if it fits and the first width characters if not.  More than 3 places means 6.
+	unsigned long long v = value < 0 ? -(unsigned long long) value : value, div = 1, p = 1, rem;
+	char t[48];
+	int i, n;
+	
+	if (decimals > 3) decimals = 6;
+	for (i = decimals; i < 6; i++) div *= 10;
+	for (i = 0; i < decimals; i++) p *= 10;
+	rem = v % div;
+	v /= div;
+	if (rem * 2 > div || (rem * 2 == div && (v & 1))) v++;
+	n = sprintf(t, "%s%llu", value < 0 ? "-" : "", v / p);
+	if (decimals) n += sprintf(t + n, ".%0*llu", decimals, v % p);
+	if (n >= width) memcpy(s, t, width);
+	else sprintf(s, "%*s", width, t);
+	return s;
+}
+
+/**************/
+/* CHECKMODEL */
+/**************/
+int checkModel(struct model * m, long long * val, int * decimals, int n) {
+	// Encode n values with a model and compare them with refframe's for Rico9, and with refText
+	// for the others wherever the places are given.  Return how many differ.
+	union frame a, b;
+	char s[VALUEMAX + 1];
+	int i, j, sum, differ = 0;
+	
+	for (i = 0; i < n; i++) {
+		refframe(&a, 1, 1, val[i], decimals[i]);
+		m->encode(&b, 1, 1, val[i], decimals[i]);
+		for (j = sum = 0; j < m->width + 3; j++) sum += b.raw[j];
+		if (b.raw[m->width + 3] != (sum & 0xff) || (m->width + 4 < FRAMELEN && b.raw[m->width + 4] != 0)) {
+			if (differ++ < 5) printf("%s: bad checksum or padding for %lld\n", m->name, val[i]);
+			continue;
+		}
+		if (m->width == 9 ? memcmp(a.raw, b.raw, 13) != 0		// the same frame exactly
+			: decimals[i] >= 0 && memcmp(refText(s, m->width, val[i], decimals[i]), b.s.value, m->width) != 0) {
+			if (differ++ < 5) printf("%s: %lld places %d should be '%.*s' is '%.*s'\n", m->name, val[i], decimals[i], 
+				m->width, m->width == 9 ? a.s.value : s, m->width, b.s.value);
+		}
+	}
+	return differ;
+}
+
+// The ways a value reaches the display from the MCP: kw, w, kwh (and its CO2) and disp
+#define KW	0
+#define W	1
+#define KWH	2
+#define CO2	3
+#define DISP 4
+
+/***********/
+/* OLDPATH */
+/***********/
+void oldpath(union frame * f, int kind, char * text, int decimals) {
+	float val, factor = 0.43;
+	sscanf(text, "%f", &val);
+	switch (kind) {
+	case KW: oldframe(f, 1, 3, val, 3); break;
+	case W: oldframe(f, 1, 3, val * 1000.0, 0); break;
+	case KWH: oldframe(f, 1, 5, val, -1); break;
+	case CO2: oldframe(f, 1, 8, val * factor, -1); break;
+	case DISP: oldframe(f, 1, 1, val, decimals); break;
+	}
+}
+
+/***********/
+/* NEWPATH */
+/***********/
+void newpath(union frame * f, int kind, char * text, int decimals) {
+	long long val, factor = 430000;
+	parseFixed(text, &val, NULL);
+	switch (kind) {
+	case KW: ricoframe(f, 1, 3, val, 3); break;
+	case W: ricoframe(f, 1, 3, val * 1000, 0); break;
+	case KWH: ricoframe(f, 1, 5, val, -1); break;
+	case CO2: ricoframe(f, 1, 8, fixMul(val, factor), -1); break;
+	case DISP: ricoframe(f, 1, 1, val, decimals); break;
+	}
+}
+
+/********/
+/* MAIN */
+/********/
+int main(int argc, char * argv[]) {
+	static char text[NUMVALUES][24];
+	static int kind[NUMVALUES], decimals[NUMVALUES];
+	static long long val[NUMVALUES], wideval[NUMVALUES];
+	union frame a, b;
+	unsigned long seed = 12345;
+	int i, n, iterations = 200, differ = 0, wide = 0;
+	long long start;
+	long oldms, newms;
+	unsigned sink = 0;
+	char * cp;
+	
+	if (argc > 1) iterations = atoi(argv[1]);
+	
+	// Values as the MCP sends them: up to 9 digits with 0 to 4 places, some negative
+	for (i = 0; i < NUMVALUES; i++) {
+		long mant;
+		int places;
+		seed = seed * 1103515245 + 12345;
+		kind[i] = (seed >> 8) % 5;
+		decimals[i] = (seed >> 12) % 5 - 1;
+		places = (seed >> 16) % 5;
+		seed = seed * 1103515245 + 12345;
+		mant = (seed >> 4) % (kind[i] == KW || kind[i] == W ? 100000 : 100000000);
+		for (n = (seed >> 2) % 4; n > 0; n--) mant /= 10;	// spread of magnitudes
+		if (kind[i] == DISP && (seed & 1)) mant = -mant;
+		if (places)
+			sprintf(text[i], "%s%ld.%0*ld", mant < 0 ? "-" : "", labs(mant) / 100000, places, 
+				labs(mant) % 100000 % (places == 1 ? 10 : places == 2 ? 100 : places == 3 ? 1000 : 10000));
+		else
+			sprintf(text[i], "%ld", mant);
+	}
+	
+	for (i = 0; i < NUMVALUES; i++) {
+		oldpath(&a, kind[i], text[i], decimals[i]);
+		newpath(&b, kind[i], text[i], decimals[i]);
+		if (memcmp(a.raw, b.raw, framelen)) {
+			// A float only holds 7 significant digits, beyond which its output was wrong anyway
+			for (n = 0, cp = text[i]; *cp; cp++) if (*cp >= '0' && *cp <= '9' && (n || *cp != '0')) n++;
+			if (n > 7 || kind[i] == W || (kind[i] == CO2 && n > 5)) {		// scaling uses up digits too
+				wide++;
+				continue;
+			}
+			if (differ++ < 10)
+				printf("Differ: kind %d '%s' decimals %d: float '%.9s' fixed '%.9s'\n", 
+					kind[i], text[i], decimals[i], a.s.value, b.s.value);
+		}
+	}
+	printf("%d of %d values differ, and %d more with too many digits for a float\n", differ, NUMVALUES, wide);
+	
+	start = msNow();
+	for (n = 0; n < iterations; n++)
+		for (i = 0; i < NUMVALUES; i++) {
+			oldpath(&a, kind[i], text[i], decimals[i]);
+			sink += a.raw[12];
+		}
+	oldms = msNow() - start;
+	start = msNow();
+	for (n = 0; n < iterations; n++)
+		for (i = 0; i < NUMVALUES; i++) {
+			newpath(&b, kind[i], text[i], decimals[i]);
+			sink += b.raw[12];
+		}
+	newms = msNow() - start;
+	
+	n = iterations * NUMVALUES;
+	printf("float: %ld ms for %d values, %.3f us each\n", oldms, n, oldms * 1000.0 / n);
+	printf("fixed: %ld ms for %d values, %.3f us each\n", newms, n, newms * 1000.0 / n);
+	if (newms) printf("speedup %.1fx (%u)\n", (double) oldms / newms, sink & 1);
+	
+	// The encoders by themselves, on the values as ricoframe gets them
+	for (i = 0; i < NUMVALUES; i++) parseFixed(text[i], &val[i], NULL);
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+		printf("%s: %d of %d frames differ\n", models[i].name, checkModel(&models[i], val, decimals, NUMVALUES), NUMVALUES);
+	
+	// And values up to 12 digits, as wide as Rico12 shows, which must parse exactly
+	for (i = n = 0; i < NUMVALUES; i++) {
+		long long mant, exact;
+		int places;
+		seed = seed * 1103515245 + 12345;
+		mant = (seed >> 8) % 1000000;
+		places = (seed >> 4) % 5;
+		decimals[i] = (seed >> 12) % 5 - 1;
+		seed = seed * 1103515245 + 12345;
+		mant = mant * 1000000 + (seed >> 8) % 1000000;
+		for (exact = mant, wide = places; wide < 6; wide++) exact *= 10;
+		if (seed & 1) {
+			mant = -mant;
+			exact = -exact;
+		}
+		if (places)
+			sprintf(text[i], "%s%lld.%0*lld", mant < 0 ? "-" : "", llabs(mant) / (places == 1 ? 10 : places == 2 ? 100 : 
+				places == 3 ? 1000 : 10000), places, llabs(mant) % (places == 1 ? 10 : places == 2 ? 100 : places == 3 ? 1000 : 10000));
+		else
+			sprintf(text[i], "%lld", mant);
+		parseFixed(text[i], &wideval[i], NULL);
+		if (wideval[i] != exact && n++ < 5) printf("'%s' parsed as %lld\n", text[i], wideval[i]);
+	}
+	printf("%d of %d wide values parsed wrongly\n", n, NUMVALUES);
+	for (i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+		printf("%s: %d of %d wide frames differ\n", models[i].name, checkModel(&models[i], wideval, decimals, NUMVALUES), NUMVALUES);
+	start = msNow();
+	for (n = 0; n < iterations; n++)
+		for (i = 0; i < NUMVALUES; i++) {
+			refframe(&a, 1, 1, val[i], decimals[i]);
+			sink += a.raw[12];
+		}
+	oldms = msNow() - start;
+	start = msNow();
+	for (n = 0; n < iterations; n++)
+		for (i = 0; i < NUMVALUES; i++) {
+			encodeRico9(&b, 1, 1, val[i], decimals[i]);
+			sink += b.raw[12];
+		}
+	newms = msNow() - start;
+	n = iterations * NUMVALUES;
+	printf("before models: %ld ms for %d frames, %.3f us each\n", oldms, n, oldms * 1000.0 / n);
+	printf("Rico9 encoder: %ld ms for %d frames, %.3f us each (%u)\n", newms, n, newms * 1000.0 / n, sink & 1);
+	return 0;
+}
@@ -0,0 +1,430 @@
+/* RICO end to end load benchmark */
+
+/* Runs rico against a fake MCP and an emulated display so that its throughput and latency
+   can be measured without the hardware.
+   The fake MCP listens where rico expects to find the real one and, once rico has logged on,
+   sends kw, kwh and disp commands at a steady rate.  Each carries a sequence number as its
+   value so that it can be recognised when it reaches the display.
+   The display emulator sits on the master side of a pty whose slave rico opens as its serial
+   port.  It takes bytes no faster than the baud rate would deliver them, decodes the frames,
+   13 bytes for the default Rico9 and as -M says for the other models, and replies '<', a NAK
+   or nothing at all.
+   At the end it reports updates per second, end to end latency percentiles (from the command
+   being written to the last byte of its frame arriving) and the updates that were overtaken
+   by a newer value, arrived out of order or never arrived.
+
+   With -S the values go through rico's shared memory table (see ricoshm.h) instead of as
+   MCP messages, kw and kwh being stored with the places those commands would have used.
+   With -M rico is run for that display model too.  A model with fewer than 8 displays only
+   gets the commands for displays it has: kw rather than kwh, and disp to the lower ones.
+   Sequence numbers too wide for a narrow model's field can't be recognised, so keep runs
+   short enough for them to fit.
+
+   Usage: ricoload [-r rate] [-t seconds] [-b baud] [-m mix%] [-n nak%] [-s silent%] [-p path] [-M model] [-S] [-v]
+   Build with 'make load'.  The rico under test is ./rico unless -p says otherwise.
+*/
+
+#define _GNU_SOURCE		/* for the pty calls */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ricoshm.h"
+
+#define PROGNAME "Ricoload"
+#define PORTNO 10010		/* where rico looks for the MCP */
+#define FRAMEMAX 16			/* longest frame of any model */
+#define RICOACK '<'
+#define RICONAK '>'			/* rico counts anything other than RICOACK as a failure */
+#define RING 4096			/* recent updates remembered per display */
+#define MAXSAMPLES 1000000
+#define DRAIN 2000000		/* us allowed after the last update for rico to catch up */
+
+// Displays the commands arrive on.  kw goes to 3 with three decimals and kwh to 5, with
+// CO2 on 8 which can't be matched to anything.  disp is spread over the rest.
+int dispDisplays[] = {1, 2, 4, 6, 7};
+#define NUMDISP (sizeof(dispDisplays) / sizeof(dispDisplays[0]))
+
+// Display models, as in rico.c: characters in the value field and displays on each controller
+struct {
+	const char * name;
+	int width, displays;
+} models[] = {{"Rico9", 9, 8}, {"Rico6", 6, 4}, {"Rico12", 12, 8}};
+#define NUMMODELS (sizeof(models) / sizeof(models[0]))
+
+// Procedures in this file
+long long usNow(void);			// monotonic microseconds
+void usage(void);
+int mcpListen(void);			// listening socket on PORTNO
+void mcpSend(int fd, const char * msg);	// length prefixed message
+void mcpRead(int fd);			// swallow anything rico says
+void nextUpdate(int fd);		// send one kw, kwh or disp
+void frame(unsigned char * f, int ptyfd);	// a whole frame has arrived
+int cmp(const void * a, const void * b);	// for qsort
+void report(double secs);
+
+/* GLOBALS */
+int verbose = 0;
+int model = 0;		// -M, index into models[]
+int framelen = 13;	// bytes in each of its frames
+int numdisp = NUMDISP;	// dispDisplays it has
+struct ricoshm * shm = NULL;	// with -S
+int shmefd = -1;
+int mix = 20;		// percentage of kw and kwh
+int nak = 0, silent = 0;	// percentage of frames to reply to with a NAK or not at all
+long seq = 0;		// updates sent, and value of the latest
+struct {
+	long seq;		// update stored here, or 0
+	long long us;	// when it was sent
+} sent[9][RING];
+long last[9];		// latest update sent to each display
+long shown[9];		// latest update seen on each display
+long long * samples;	// latencies in us
+int numsamples = 0;
+long frames = 0, delivered = 0, repeats = 0, outoforder = 0, unknown = 0, badframes = 0, naks = 0, unanswered = 0;
+char rxbuf[1024];	// what rico sends the MCP
+int rxlen = 0;
+
+/********/
+/* MAIN */
+/********/
+int main(int argc, char * argv[]) {
+	int option, listenfd, sockfd = -1, ptyfd, status, n;
+	int baud = 9600, secs = 10;
+	double rate = 100;
+	char * rico = "./rico";
+	char * slave;
+	pid_t pid;
+	long long start, next, now, end, interval, bytetime, wire;
+	unsigned char f[FRAMEMAX], buf[256];
+	int flen = 0, i, idle = 1, useshm = 0;
+	struct pollfd pfd[3];
+	char * args[10];
+
+	while ((option = getopt(argc, argv, "r:t:b:m:n:s:p:M:Sv")) != -1) {
+		switch (option) {
+		case 'r': rate = atof(optarg); break;
+		case 't': secs = atoi(optarg); break;
+		case 'b': baud = atoi(optarg); break;
+		case 'm': mix = atoi(optarg); break;
+		case 'n': nak = atoi(optarg); break;
+		case 's': silent = atoi(optarg); break;
+		case 'p': rico = optarg; break;
+		case 'v': verbose = 1; break;
+		case 'S': useshm = 1; break;
+		case 'M':
+			for (model = 0; model < NUMMODELS && strcmp(optarg, models[model].name); model++) ;
+			if (model == NUMMODELS) {
+				usage();
+				return 1;
+			}
+			break;
+		default: usage(); return 1;
+		}
+	}
+	framelen = models[model].width + 4;
+	while (dispDisplays[numdisp - 1] > models[model].displays) numdisp--;
+	if (rate <= 0 || secs <= 0 || (baud != 9600 && baud != 2400)) {		// the speeds rico can run at
+		usage();
+		return 1;
+	}
+	samples = malloc(MAXSAMPLES * sizeof(long long));
+
+	// The display end: rico gets the slave side of a pty as its serial port
+	if ((ptyfd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(ptyfd) || unlockpt(ptyfd)) {
+		perror(PROGNAME " pty");
+		return 1;
+	}
+	slave = ptsname(ptyfd);
+	listenfd = mcpListen();
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((pid = fork()) == 0) {
+		close(listenfd);
+		close(ptyfd);
+		n = 0;
+		args[n++] = rico;
+		args[n++] = "-l";
+		if (useshm) args[n++] = "-S";
+		if (baud == 2400) args[n++] = "-L";	// so rico paces frames as the emulator takes them
+		args[n++] = "-M";
+		args[n++] = (char *) models[model].name;
+		args[n++] = slave;
+		args[n++] = "1";
+		args[n] = NULL;
+		execv(rico, args);
+		perror(PROGNAME " exec");
+		_exit(1);
+	}
+	fprintf(stderr, "Running %s on %s for %s: %.0f updates/s for %d s at %d baud, %d%% kw/kwh, %d%% NAK, %d%% silent\n",
+		rico, slave, models[model].name, rate, secs, baud, mix, nak, silent);
+
+	// Wait for the logon
+	pfd[0].fd = listenfd;
+	pfd[0].events = POLLIN;
+	if (poll(pfd, 1, 5000) <= 0 || (sockfd = accept(listenfd, NULL, NULL)) < 0) {
+		fprintf(stderr, PROGNAME " rico did not connect\n");
+		kill(pid, SIGTERM);
+		return 1;
+	}
+	for (i = 0; useshm && i < 200 && !(shm = ricoshmAttach(1, &shmefd)); i++) usleep(10000);
+	if (useshm && !shm) {
+		fprintf(stderr, PROGNAME " can't attach to rico's shared memory\n");
+		kill(pid, SIGTERM);
+		return 1;
+	}
+
+	interval = 1000000 / rate;
+	bytetime = 10000000LL / baud;		// start, 8 data and stop bits
+	start = next = usNow();
+	end = start + secs * 1000000LL;
+	wire = start;		// when the display will have taken the next byte
+	pfd[0].fd = sockfd;
+	pfd[1].fd = ptyfd;
+
+	while ((now = usNow()) < end + DRAIN) {
+		while (now < end && now >= next) {
+			nextUpdate(sockfd);
+			next += interval;
+		}
+		// Only read as much as the line could have carried by now
+		if (idle && wire < now - bytetime) wire = now - bytetime;	// no credit for an idle line
+		n = (now - wire) / bytetime;
+		pfd[1].events = n ? POLLIN : 0;
+		pfd[0].events = POLLIN;
+		i = n ? (now < end ? next - now : 10000) : bytetime;
+		if (poll(pfd, 2, i / 1000 + 1) < 0 && errno != EINTR) break;
+		if (pfd[0].revents & POLLIN) mcpRead(sockfd);
+		if (n) idle = !(pfd[1].revents & POLLIN);
+		if (pfd[1].revents & POLLIN) {
+			if (n > (int) sizeof(buf)) n = sizeof(buf);
+			n = read(ptyfd, buf, n);
+			if (n <= 0) {
+				fprintf(stderr, PROGNAME " rico has closed the pty\n");
+				break;
+			}
+			wire += n * bytetime;
+			for (i = 0; i < n; i++) {
+				if (flen == 0 && buf[i] != 'N') {	// not in step: wait for the next 'N'
+					badframes++;
+					continue;
+				}
+				f[flen++] = buf[i];
+				if (flen == framelen) {
+					frame(f, ptyfd);
+					flen = 0;
+				}
+			}
+		}
+	}
+
+	mcpSend(sockfd, "exit");
+	for (i = 0; i < 20 && waitpid(pid, &status, WNOHANG) == 0; i++) usleep(100000);
+	if (i == 20) {
+		kill(pid, SIGTERM);
+		waitpid(pid, &status, 0);
+	}
+	report(secs);
+	return 0;
+}
+
+/*********/
+/* USAGE */
+/*********/
+void usage(void) {
+	printf("Usage: ricoload [-r rate] [-t seconds] [-b baud] [-m mix%%] [-n nak%%] [-s silent%%] [-p path] [-M model] [-S] [-v]\n");
+	printf("-r updates per second (100) -t run time (10) -b baud rate, 9600 or 2400 (9600)\n");
+	printf("-m percentage of kw and kwh commands, the rest are disp (20)\n");
+	printf("-n percentage of frames answered with a NAK -s with nothing\n");
+	printf("-p rico to run (./rico) -S send values through shared memory -v show what rico tells the MCP\n");
+	printf("-M display model, as for rico: Rico9 (the default), Rico6 or Rico12\n");
+}
+
+/*********/
+/* USNOW */
+/*********/
+long long usNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*************/
+/* MCPLISTEN */
+/*************/
+int mcpListen(void) {
+	int fd, on = 1;
+	struct sockaddr_in addr;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(PORTNO);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		perror(PROGNAME " can't listen for rico (is an MCP running?)");
+		exit(1);
+	}
+	return fd;
+}
+
+/***********/
+/* MCPSEND */
+/***********/
+void mcpSend(int fd, const char * msg) {
+	// Same framing as sockSend in rico: 2 byte length, network order, then the text
+	unsigned char buf[300];
+	int len = strlen(msg);
+	buf[0] = len >> 8;
+	buf[1] = len & 0xff;
+	memcpy(buf + 2, msg, len);
+	if (write(fd, buf, len + 2) != len + 2) perror(PROGNAME " write to rico");
+}
+
+/***********/
+/* MCPREAD */
+/***********/
+void mcpRead(int fd) {
+	// Take whatever rico has sent, showing complete messages if asked to
+	int n, len;
+	n = read(fd, rxbuf + rxlen, sizeof(rxbuf) - rxlen);
+	if (n <= 0) return;
+	rxlen += n;
+	while (rxlen >= 2 && rxlen >= 2 + (len = (unsigned char) rxbuf[0] << 8 | (unsigned char) rxbuf[1])) {
+		if (verbose) fprintf(stderr, "MCP got: %.*s\n", len, rxbuf + 2);
+		rxlen -= 2 + len;
+		memmove(rxbuf, rxbuf + 2 + len, rxlen);
+	}
+	if (rxlen == sizeof(rxbuf)) rxlen = 0;	// nonsense: start again
+}
+
+/**************/
+/* NEXTUPDATE */
+/**************/
+void nextUpdate(int fd) {
+	// Send the next update, remembering when and where it should turn up
+	char msg[64];
+	int d, decimals;
+	long long now, value;
+
+	seq++;
+	if (rand() % 100 < mix) {
+		if (seq & 1 || models[model].displays < 5) {		// kwh's display 5 may not be there
+			sprintf(msg, "kw %ld.%03ld", seq / 1000, seq % 1000);
+			d = 3;
+			value = seq * 1000LL;
+			decimals = 3;
+		} else {
+			sprintf(msg, "kwh %ld", seq);
+			d = 5;
+			value = seq * 1000000LL;
+			decimals = -1;
+		}
+	} else {
+		d = dispDisplays[seq % numdisp];
+		sprintf(msg, "disp %d %ld 0", d, seq);
+		value = seq * 1000000LL;
+		decimals = 0;
+	}
+	now = usNow();
+	if (shm) ricoshmPut(shm, shmefd, d, value, decimals);
+	else mcpSend(fd, msg);
+	sent[d][seq % RING].seq = seq;
+	sent[d][seq % RING].us = now;
+	last[d] = seq;
+}
+
+/*********/
+/* FRAME */
+/*********/
+void frame(unsigned char * f, int ptyfd) {
+	// Check a frame, reply to it and match it to the update it shows
+	int i, sum = 0, d;
+	char value[13], reply;
+	long s;
+
+	frames++;
+	for (i = 0; i < framelen - 1; i++) sum += f[i];
+	d = f[2];
+	if ((sum & 0xff) != f[framelen - 1] || d < 1 || d > models[model].displays) {
+		badframes++;
+		reply = RICONAK;
+		write(ptyfd, &reply, 1);
+		return;
+	}
+	i = rand() % 100;
+	if (i < nak) {
+		naks++;
+		reply = RICONAK;
+		write(ptyfd, &reply, 1);
+	} else if (i < nak + silent)
+		unanswered++;
+	else {
+		reply = RICOACK;
+		write(ptyfd, &reply, 1);
+	}
+
+	if (d == 8) return;		// CO2 from kwh: not a sequence number
+	memcpy(value, f + 3, models[model].width);
+	value[models[model].width] = 0;
+	s = atof(value) * (d == 3 ? 1000 : 1) + 0.5;
+	if (s <= 0 || sent[d][s % RING].seq != s) {
+		unknown++;
+		return;
+	}
+	if (s == shown[d]) {
+		repeats++;
+		return;
+	}
+	if (s < shown[d]) {
+		outoforder++;
+		return;
+	}
+	shown[d] = s;
+	delivered++;
+	if (numsamples < MAXSAMPLES) samples[numsamples++] = usNow() - sent[d][s % RING].us;
+}
+
+/*******/
+/* CMP */
+/*******/
+int cmp(const void * a, const void * b) {
+	long long x = *(const long long *) a, y = *(const long long *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**********/
+/* REPORT */
+/**********/
+void report(double secs) {
+	int d, stale = 0;
+
+	for (d = 1; d <= 8; d++)
+		if (d != 8 && last[d] && shown[d] != last[d]) stale++;
+	printf("Updates sent       %ld (%.1f/s)\n", seq, seq / secs);
+	printf("Frames received    %ld (%.1f/s), %ld bad, %ld NAKed, %ld unanswered\n",
+		frames, frames / secs, badframes, naks, unanswered);
+	printf("Updates displayed  %ld (%.1f/s, %.1f%%)\n", delivered, delivered / secs, seq ? 100.0 * delivered / seq : 0);
+	printf("Not displayed      %ld (overtaken by a newer value, or lost)\n", seq - delivered);
+	printf("Repeated           %ld\n", repeats);
+	printf("Out of order       %ld\n", outoforder);
+	printf("Unrecognised       %ld\n", unknown);
+	printf("Stale displays     %d (not showing the last value sent at the end)\n", stale);
+	if (numsamples) {
+		qsort(samples, numsamples, sizeof(long long), cmp);
+		printf("Latency ms         p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+			samples[numsamples / 2] / 1000.0, samples[numsamples * 9 / 10] / 1000.0,
+			samples[numsamples * 99 / 100] / 1000.0, samples[numsamples - 1] / 1000.0);
+	}
+}
@@ -0,0 +1,116 @@
+/* RICO shared memory display table */
+
+/* Local producers can hand rico display values through shared memory instead of the MCP.
+   With -S rico creates RICOSHMFILE for each controller: a table of eight display slots,
+   each protected by a sequence lock.  A producer stores a value in a slot and then writes
+   to rico's eventfd to wake it; rico reads every slot whose sequence has moved on and
+   sends the latest value, so values written faster than the line can carry are coalesced
+   just as those from the MCP are.  The table is readable and writable by rico's user and
+   group only, so producers run as that user or in that group.  Rico won't use a table that
+   is a link or that another user owns.
+
+   A producer gets the eventfd by connecting to the abstract unix socket named in the table
+   header; rico sends it as SCM_RIGHTS and closes the connection.  ricoshmAttach and ricoshmPut
+   below do all of this.
+
+   Several producers may write to the table.  A slot's sequence is odd while it is being
+   written, so writers to the same slot take turns and the reader never sees half a value.
+*/
+
+#ifndef RICOSHM_H
+#define RICOSHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RICOSHMFILE "/dev/shm/rico%d"	/* controller number */
+#define RICOSHMMAGIC 0x5249434fU		/* RICO */
+#define RICOSHMSLOTS 9				/* indexed by display number, 1 to 8 */
+
+struct ricoshmslot {
+	volatile uint32_t seq;		// even when stable, odd while a writer is in it
+	int32_t decimals;			// places after the point, -1 to place it automatically
+	int64_t value;				// in millionths: 12.5 is 12500000
+};
+
+struct ricoshm {
+	uint32_t magic;
+	uint32_t pid;				// rico's
+	char sock[32];				// abstract unix socket that hands out the eventfd, without the leading NUL
+	struct ricoshmslot slot[RICOSHMSLOTS];
+};
+
+/*****************/
+/* RICOSHMATTACH */
+/*****************/
+static inline struct ricoshm * ricoshmAttach(int controller, int * efd) {
+	// Map the table for a controller and fetch rico's eventfd into *efd.
+	// Return NULL if rico is not running with -S.
+	char name[64];
+	int fd;
+	struct ricoshm * shm;
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr * cmsg;
+	struct iovec iov;
+	char byte, control[CMSG_SPACE(sizeof(int))];
+
+	sprintf(name, RICOSHMFILE, controller);
+	if ((fd = open(name, O_RDWR | O_NOFOLLOW)) < 0) return NULL;
+	shm = (struct ricoshm *) mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) return NULL;
+	if (shm->magic != RICOSHMMAGIC || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		munmap(shm, sizeof(*shm));
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path + 1, shm->sock, sizeof(addr.sun_path) - 2);
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	*efd = -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && recvmsg(fd, &msg, 0) > 0
+		&& (cmsg = CMSG_FIRSTHDR(&msg)) && cmsg->cmsg_type == SCM_RIGHTS)
+		memcpy(efd, CMSG_DATA(cmsg), sizeof(int));
+	close(fd);
+	if (*efd < 0) {
+		munmap(shm, sizeof(*shm));
+		return NULL;
+	}
+	return shm;
+}
+
+/**************/
+/* RICOSHMPUT */
+/**************/
+static inline void ricoshmPut(struct ricoshm * shm, int efd, int display, int64_t value, int decimals) {
+	// Store a value for a display and wake rico.  value is in millionths.
+	struct ricoshmslot * s;
+	uint32_t seq;
+	uint64_t one = 1;
+
+	if (display < 1 || display >= RICOSHMSLOTS) return;
+	s = &shm->slot[display];
+	do seq = s->seq & ~1U;		// wait for any other writer to finish
+	while (!__sync_bool_compare_and_swap(&s->seq, seq, seq + 1));
+	__sync_synchronize();
+	s->value = value;
+	s->decimals = decimals;
+	__sync_synchronize();
+	s->seq = seq + 2;
+	if (write(efd, &one, sizeof(one)) < 0) return;	// already pending is fine too
+}
+
+#endif